@@ -0,0 +1,262 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Andrea Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * File transfer benchmark: a sender and a recipient connect to a running
+ * chatlite server, the sender /send's a file of the given size to the
+ * recipient, which /accept's it, the server relaying it with splice in
+ * pieces, each after a header. The same bytes are then
+ * pushed through a direct loopback TCP connection, the ceiling a relay can
+ * get close to. Reports the throughput of both.
+ *
+ * Usage: file_transfer [-s size in MB] [-p port]
+ *
+ * The auth token is read from CHATLITE_TOKEN.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ADDR "127.0.0.1"
+#define PORT 6699
+#define SIZE_MB 512
+#define CHUNK (256 * 1024)
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int connect_tcp(int port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    inet_pton(AF_INET, ADDR, &addr.sin_addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Read until `marker` shows up, returns the bytes that followed it in the
+ * last read, -1 if the connection drops
+ */
+static ssize_t read_until(int fd, const char *marker) {
+    char buf[4096];
+    size_t len = 0, mlen = strlen(marker);
+    for (;;) {
+        ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n <= 0)
+            return -1;
+        len += n;
+        buf[len] = '\0';
+        char *m = memmem(buf, len, marker, mlen);
+        if (m)
+            return buf + len - (m + mlen);
+        // Keep a tail long enough to match a marker split across reads
+        if (len > sizeof(buf) / 2) {
+            memmove(buf, buf + len - 128, 128);
+            len = 128;
+        }
+    }
+}
+
+static int join(int fd, const char *token, const char *nick) {
+    char line[256];
+    int len =
+        snprintf(line, sizeof(line), "/auth %s\n/nick %s\n", token, nick);
+    if (write(fd, line, len) != len)
+        return -1;
+    // The welcome ends with an empty line
+    return read_until(fd, "\n\n") < 0 ? -1 : 0;
+}
+
+/*
+ * A file received from the server, in pieces each after a
+ * "Server\r\n<nick> sends <n> bytes\n" header: `left` the bytes of the
+ * current piece still to come, `head` the header read so far
+ */
+typedef struct {
+    uint64_t left;
+    char head[128];
+    size_t headlen;
+} Pieces;
+
+// Count the file bytes among the `n` in `buf`, headers left out
+static uint64_t pieces_feed(Pieces *p, const char *buf, size_t n) {
+    uint64_t got = 0;
+    while (n > 0) {
+        if (p->left > 0) {
+            size_t take = n < p->left ? n : p->left;
+            p->left -= take;
+            got += take;
+            buf += take;
+            n -= take;
+            continue;
+        }
+        char c = *buf++;
+        n--;
+        if (p->headlen < sizeof(p->head) - 1)
+            p->head[p->headlen++] = c;
+        // The nick ends with \r\n, the message with a bare \n
+        if (c != '\n' || (p->headlen > 1 && p->head[p->headlen - 2] == '\r'))
+            continue;
+        p->head[p->headlen] = '\0';
+        char *sends = strstr(p->head, " sends ");
+        if (sends)
+            p->left = strtoull(sends + 7, NULL, 10);
+        p->headlen = 0;
+    }
+    return got;
+}
+
+/*
+ * Write `size` bytes to `tx` while reading them back from `rx`, through
+ * `pieces` unless it's NULL; returns the time it took in ns, -1 on error
+ */
+static int64_t pump(int tx, int rx, uint64_t size, Pieces *pieces) {
+    static char buf[CHUNK];
+    uint64_t sent = 0, got = 0;
+    fcntl(tx, F_SETFL, fcntl(tx, F_GETFL) | O_NONBLOCK);
+    int64_t start = now_ns();
+    while (got < size) {
+        struct pollfd fds[2] = {
+            {.fd = rx, .events = POLLIN},
+            {.fd = tx, .events = sent < size ? POLLOUT : 0}};
+        if (poll(fds, 2, 5000) <= 0)
+            return -1;
+        if (fds[1].revents & POLLOUT) {
+            size_t want = size - sent < CHUNK ? size - sent : CHUNK;
+            ssize_t n = write(tx, buf, want);
+            if (n > 0)
+                sent += n;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = read(rx, buf, sizeof(buf));
+            if (n <= 0)
+                return -1;
+            got += pieces ? pieces_feed(pieces, buf, n) : (uint64_t)n;
+        }
+    }
+    return now_ns() - start;
+}
+
+static void report(const char *name, uint64_t size, int64_t ns) {
+    printf("%-8s %lu MB in %.1f ms, %.0f MB/s\n", name, size >> 20, ns / 1e6,
+           (size / 1048576.0) / (ns / 1e9));
+}
+
+static int relay(int port, uint64_t size, const char *token) {
+    int tx = connect_tcp(port), rx = connect_tcp(port);
+    char nick[32];
+    snprintf(nick, sizeof(nick), "bench%d", getpid());
+    if (tx < 0 || rx < 0 || join(rx, token, nick) < 0 ||
+        join(tx, token, "bench_tx") < 0) {
+        fprintf(stderr, "relay: can't connect\n");
+        return -1;
+    }
+    char line[128];
+    int len = snprintf(line, sizeof(line), "/send %s %lu\n", nick, size);
+    int64_t start = now_ns();
+    if (write(tx, line, len) != len)
+        return -1;
+    // Nothing comes before the offer is accepted
+    Pieces pieces = {0};
+    int64_t ns = read_until(rx, "/accept to take it\n") < 0 ||
+                         write(rx, "/accept\n", 8) != 8
+                     ? -1
+                     : pump(tx, rx, size, &pieces);
+    if (ns < 0) {
+        fprintf(stderr, "relay: connection lost\n");
+        return -1;
+    }
+    report("relay", size, now_ns() - start);
+    close(tx);
+    close(rx);
+    return 0;
+}
+
+static int direct(uint64_t size) {
+    struct sockaddr_in addr = {.sin_family = AF_INET};
+    socklen_t addrlen = sizeof(addr);
+    inet_pton(AF_INET, ADDR, &addr.sin_addr);
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lfd, 1) < 0 ||
+        getsockname(lfd, (struct sockaddr *)&addr, &addrlen) < 0)
+        return -1;
+    int tx = connect_tcp(ntohs(addr.sin_port));
+    int rx = accept(lfd, NULL, NULL);
+    close(lfd);
+    int64_t ns = tx < 0 || rx < 0 ? -1 : pump(tx, rx, size, NULL);
+    if (ns < 0) {
+        fprintf(stderr, "direct: connection lost\n");
+        return -1;
+    }
+    report("direct", size, ns);
+    close(tx);
+    close(rx);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int port = PORT, opt;
+    uint64_t size = (uint64_t)SIZE_MB << 20;
+    while ((opt = getopt(argc, argv, "s:p:")) != -1) {
+        switch (opt) {
+        case 's':
+            size = strtoull(optarg, NULL, 10) << 20;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s size in MB] [-p port]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    const char *token = getenv("CHATLITE_TOKEN");
+    if (token == NULL) {
+        fprintf(stderr, "CHATLITE_TOKEN not set\n");
+        return EXIT_FAILURE;
+    }
+
+    if (relay(port, size, token) < 0 || direct(size) < 0)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
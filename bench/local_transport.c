@@ -0,0 +1,186 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Andrea Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * TCP loopback against Unix socket benchmark: a sender and a receiver
+ * connect to a running chatlite server, both over TCP or both over the
+ * Unix socket, and the sender posts messages one at a time, each only
+ * once the receiver got the previous one through the broadcast. Reports
+ * the round trip latency percentiles and the resulting message rate for
+ * each transport.
+ *
+ * Usage: local_transport [-n messages] [-p port] [-u unix socket path]
+ *
+ * The auth token is read from CHATLITE_TOKEN.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ADDR "127.0.0.1"
+#define PORT 6699
+#define UNIX_PATH "chatlite.sock"
+#define MESSAGES 20000
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int connect_tcp(int port) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    inet_pton(AF_INET, ADDR, &addr.sin_addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    return fd;
+}
+
+static int connect_unix(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Read until `marker` shows up, returns -1 if the connection drops
+static int read_until(int fd, const char *marker) {
+    char buf[4096];
+    size_t len = 0;
+    for (;;) {
+        ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n <= 0)
+            return -1;
+        len += n;
+        buf[len] = '\0';
+        if (strstr(buf, marker))
+            return 0;
+        // Keep a tail long enough to match a marker split across reads
+        if (len > sizeof(buf) / 2) {
+            memmove(buf, buf + len - 64, 64);
+            len = 64;
+        }
+    }
+}
+
+static int auth(int fd, const char *token) {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "/auth %s\n", token);
+    if (write(fd, line, len) != len)
+        return -1;
+    // The welcome ends with an empty line
+    return read_until(fd, "\n\n");
+}
+
+static int cmp_ns(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int run(const char *name, int tx, int rx, int n, const char *token) {
+    if (tx < 0 || rx < 0 || auth(tx, token) < 0 || auth(rx, token) < 0) {
+        fprintf(stderr, "%s: can't connect\n", name);
+        return -1;
+    }
+    // The receiver may still get the sender join notice, let it settle
+    usleep(300 * 1000);
+
+    int64_t *rtt = malloc(n * sizeof(int64_t));
+    int64_t start = now_ns();
+    for (int i = 0; i < n; i++) {
+        char msg[64], marker[64];
+        int len = snprintf(msg, sizeof(msg), "bench %d\n", i);
+        snprintf(marker, sizeof(marker), "bench %d\n", i);
+        int64_t t = now_ns();
+        if (write(tx, msg, len) != len || read_until(rx, marker) < 0) {
+            fprintf(stderr, "%s: connection lost\n", name);
+            free(rtt);
+            return -1;
+        }
+        rtt[i] = now_ns() - t;
+    }
+    double secs = (now_ns() - start) / 1e9;
+    qsort(rtt, n, sizeof(int64_t), cmp_ns);
+    printf("%-5s %d messages, p50 %.1fus p99 %.1fus max %.1fus, %.0f msg/s\n",
+           name, n, rtt[n / 2] / 1e3, rtt[n * 99 / 100] / 1e3,
+           rtt[n - 1] / 1e3, n / secs);
+    free(rtt);
+    close(tx);
+    close(rx);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int n = MESSAGES, port = PORT, opt;
+    const char *path = UNIX_PATH;
+    while ((opt = getopt(argc, argv, "n:p:u:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            path = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-n messages] [-p port] [-u unix socket path]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    const char *token = getenv("CHATLITE_TOKEN");
+    if (token == NULL) {
+        fprintf(stderr, "CHATLITE_TOKEN not set\n");
+        return EXIT_FAILURE;
+    }
+
+    if (run("tcp", connect_tcp(port), connect_tcp(port), n, token) < 0 ||
+        run("unix", connect_unix(path), connect_unix(path), n, token) < 0)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,205 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Andrea Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Reconnect storm benchmark: connects N clients to a running chatlite
+ * server, then for a number of rounds drops them all at once and
+ * reconnects them as fast as possible, like after a deploy or a network
+ * blip. For each round it reports how long until every client got its
+ * welcome back, the bytes fanned out to the clients by the storm, i.e.
+ * join and leave notices, and, given the server pid, the CPU time the
+ * server burned.
+ *
+ * Usage: reconnect_storm [-n clients] [-r rounds] [-p port] [-P server pid]
+ *
+ * The auth token is read from CHATLITE_TOKEN.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ADDR "127.0.0.1"
+#define PORT 6699
+#define CLIENTS 500
+#define ROUNDS 3
+#define MAX_EVENTS 64
+
+// Time without any incoming byte after which a storm is over
+#define QUIET_MS 2000
+
+typedef struct {
+    int fd;
+    int welcomed;
+    char tail;
+} BenchClient;
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// User and system CPU time of a process, in ms, -1 if it can't be read
+static int64_t cpu_ms(int pid) {
+    char path[64];
+    unsigned long utime, stime;
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    int n = fscanf(f,
+                   "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu "
+                   "%lu",
+                   &utime, &stime);
+    fclose(f);
+    if (n != 2)
+        return -1;
+    return (utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
+}
+
+static int bench_connect(int port, const char *token) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    inet_pton(AF_INET, ADDR, &addr.sin_addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    char auth[128];
+    int len = snprintf(auth, sizeof(auth), "/auth %s\n", token);
+    if (write(fd, auth, len) != len) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/*
+ * Read whatever the clients received until QUIET_MS pass without a byte,
+ * returns the bytes read; `welcome_ms` is set to the time at which the
+ * last client got its welcome, which ends with an empty line
+ */
+static uint64_t bench_drain(int epfd, BenchClient *clients, int n,
+                            int64_t start, int64_t *welcome_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    char buf[4096];
+    uint64_t total = 0;
+    int pending = n;
+    for (;;) {
+        int nfds = epoll_wait(epfd, events, MAX_EVENTS, QUIET_MS);
+        if (nfds <= 0)
+            break;
+        for (int i = 0; i < nfds; i++) {
+            BenchClient *c = &clients[events[i].data.u32];
+            ssize_t r;
+            while ((r = read(c->fd, buf, sizeof(buf))) > 0) {
+                total += r;
+                if (c->welcomed)
+                    continue;
+                if ((c->tail == '\n' && buf[0] == '\n') ||
+                    memmem(buf, r, "\n\n", 2)) {
+                    c->welcomed = 1;
+                    if (--pending == 0)
+                        *welcome_ms = now_ms() - start;
+                }
+                c->tail = buf[r - 1];
+            }
+        }
+    }
+    return total;
+}
+
+int main(int argc, char **argv) {
+    int n = CLIENTS, rounds = ROUNDS, port = PORT, pid = 0, opt;
+    while ((opt = getopt(argc, argv, "n:r:p:P:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'P':
+            pid = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n clients] [-r rounds] [-p port] "
+                            "[-P server pid]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    const char *token = getenv("CHATLITE_TOKEN");
+    if (token == NULL) {
+        fprintf(stderr, "CHATLITE_TOKEN not set\n");
+        return EXIT_FAILURE;
+    }
+
+    BenchClient *clients = calloc(n, sizeof(BenchClient));
+    int epfd = epoll_create1(0);
+    for (int r = 0; r <= rounds; r++) {
+        // Round 0 just brings the clients in
+        if (r > 0)
+            for (int i = 0; i < n; i++)
+                close(clients[i].fd);
+        int64_t cpu = pid ? cpu_ms(pid) : -1;
+        int64_t start = now_ms(), welcome_ms = -1;
+        for (int i = 0; i < n; i++) {
+            clients[i] = (BenchClient){.fd = bench_connect(port, token)};
+            if (clients[i].fd < 0) {
+                perror("connect");
+                return EXIT_FAILURE;
+            }
+            struct epoll_event ev = {.events = EPOLLIN, .data.u32 = i};
+            epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &ev);
+        }
+        uint64_t bytes = bench_drain(epfd, clients, n, start, &welcome_ms);
+        if (r == 0)
+            continue;
+        printf("round %d: %d clients back in %ld ms, %lu bytes received "
+               "(%.1f per client)",
+               r, n, welcome_ms, bytes, (double)bytes / n);
+        if (cpu >= 0)
+            printf(", server cpu %ld ms", cpu_ms(pid) - cpu);
+        printf("\n");
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,191 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Andrea Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+/*
+ * Wake up latency benchmark: against one or more running chatlite
+ * servers, e.g. one started as usual and one with --busy_poll 50, a
+ * sender posts messages spaced by a gap long enough for the server to go
+ * idle, and a receiver spins on its socket waiting for each one to come
+ * back through the broadcast. The round trips then include the server
+ * waking up for every message, which is what busy polling removes.
+ * Reports the latency percentiles of each server.
+ *
+ * Usage: wakeup_latency [-n messages] [-g gap us] [-p port]...
+ *
+ * The auth token is read from CHATLITE_TOKEN.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ADDR "127.0.0.1"
+#define PORT 6699
+#define MESSAGES 5000
+#define GAP_US 1000
+#define MAX_SERVERS 8
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_connect(int port, const char *token) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    inet_pton(AF_INET, ADDR, &addr.sin_addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    char auth[128];
+    int len = snprintf(auth, sizeof(auth), "/auth %s\n", token);
+    if (write(fd, auth, len) != len) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/*
+ * Spin on a non blocking socket until `marker` shows up, so that the
+ * receiving end adds no wake up of its own; -1 if the connection drops
+ */
+static int spin_until(int fd, const char *marker) {
+    char buf[4096];
+    size_t len = 0;
+    for (;;) {
+        ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n == 0 || (n < 0 && errno != EAGAIN))
+            return -1;
+        if (n < 0)
+            continue;
+        len += n;
+        buf[len] = '\0';
+        if (strstr(buf, marker))
+            return 0;
+        // Keep a tail long enough to match a marker split across reads
+        if (len > sizeof(buf) / 2) {
+            memmove(buf, buf + len - 64, 64);
+            len = 64;
+        }
+    }
+}
+
+static void spin_for(int64_t ns) {
+    int64_t end = now_ns() + ns;
+    while (now_ns() < end)
+        ;
+}
+
+static int cmp_ns(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int run(int port, int n, int gap_us, const char *token) {
+    int tx = bench_connect(port, token), rx = bench_connect(port, token);
+    if (tx < 0 || rx < 0 || spin_until(tx, "\n\n") < 0 ||
+        spin_until(rx, "\n\n") < 0) {
+        fprintf(stderr, "port %d: can't connect\n", port);
+        return -1;
+    }
+    // The receiver may still get the sender join notice, let it settle
+    usleep(300 * 1000);
+    char drain[4096];
+    while (read(rx, drain, sizeof(drain)) > 0)
+        ;
+
+    int64_t *rtt = malloc(n * sizeof(int64_t));
+    for (int i = 0; i < n; i++) {
+        char msg[64];
+        int len = snprintf(msg, sizeof(msg), "wakeup %d\n", i);
+        spin_for((int64_t)gap_us * 1000);
+        int64_t t = now_ns();
+        if (write(tx, msg, len) != len || spin_until(rx, msg) < 0) {
+            fprintf(stderr, "port %d: connection lost\n", port);
+            free(rtt);
+            return -1;
+        }
+        rtt[i] = now_ns() - t;
+    }
+    qsort(rtt, n, sizeof(int64_t), cmp_ns);
+    printf("port %d: %d messages %dus apart, p50 %.1fus p90 %.1fus p99 "
+           "%.1fus max %.1fus\n",
+           port, n, gap_us, rtt[n / 2] / 1e3, rtt[n * 90 / 100] / 1e3,
+           rtt[n * 99 / 100] / 1e3, rtt[n - 1] / 1e3);
+    free(rtt);
+    close(tx);
+    close(rx);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int n = MESSAGES, gap_us = GAP_US, ports[MAX_SERVERS], nports = 0, opt;
+    while ((opt = getopt(argc, argv, "n:g:p:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'g':
+            gap_us = atoi(optarg);
+            break;
+        case 'p':
+            if (nports < MAX_SERVERS)
+                ports[nports++] = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n messages] [-g gap us] [-p port]...\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    const char *token = getenv("CHATLITE_TOKEN");
+    if (token == NULL) {
+        fprintf(stderr, "CHATLITE_TOKEN not set\n");
+        return EXIT_FAILURE;
+    }
+    if (nports == 0)
+        ports[nports++] = PORT;
+
+    for (int i = 0; i < nports; i++)
+        if (run(ports[i], n, gap_us, token) < 0)
+            return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
@@ -22,29 +22,196 @@
  *
  */
 
+#define _GNU_SOURCE
+
+#include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/sockios.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#include "chatlite_dict.h"
 
+// Defaults of the runtime configuration, see the CONFIGURATION section
 #define ADDR "127.0.0.1"
 #define PORT 6699
+#define WS_PORT 6700
+#define UNIX_PATH "chatlite.sock"
 #define BACKLOG 128
 #define MAX_EVENTS 64
 #define MAX_CLIENTS 1024
 #define NICK_MAXLEN 32
+#define CONFIG_LINE_MAXLEN 2048
+#define MESSAGE_MAXLEN 256
+
+// Longest line a client can send, longer ones go out in pieces
+#define LINE_MAXLEN (16 * 1024)
+
+// A formatted chat message, the sender header followed by a line
+#define CHAT_MAXLEN (NICK_MAXLEN + LINE_MAXLEN)
+
+// String interning table, see the STRING INTERNING section
+#define INTERN_BUCKETS 4096
+
+// Commands, see the COMMANDS section
+#define CMD_QUIT 0
+#define CMD_NICK 1
+#define CMD_HISTORY 2
+#define CMD_COMPRESS 3
+#define CMD_STATS 4
+#define CMD_FRIEND 5
+#define CMD_UNFRIEND 6
+#define CMD_FRIENDS 7
+#define CMD_SEND 8
+#define CMD_ACCEPT 9
+#define CMDS 10
+
+// Friend lists and presence, see the PRESENCE section
+#define FRIENDS_MAX 128
+#define PRESENCE_INTERVAL 1000
+
+// Join and leave notices batching, see the JOIN NOTICES section
+#define NOTICES_WINDOW 100
+#define NOTICES_WINDOW_MAX 1600
+#define NOTICES_BURST 32
+
+// Nodes of a cluster and their links, see the CLUSTER section
+#define CLUSTER_MAXPEERS 16
+#define NODE_MAXLEN 64
+#define LINK_HELLO 1
+#define LINK_INTEREST 2
+#define LINK_MESSAGE 3
+#define LINK_SUBMIT 4
+#define LINK_HISTORY 5
+#define LINK_HANDOFF 6
+#define LINK_HEADER_LEN 3
+#define LINK_MAXPENDING (4 * 1024 * 1024)
+#define LINK_READ_CHUNK (64 * 1024)
+
+// Rooms ownership, see the ROOM OWNERSHIP section
+#define CHAT_ROOM "main"
+#define RING_VNODES 64
+#define HANDOFF_MAX 100
+
+// Auth token, generated at startup unless set through CHATLITE_TOKEN
+#define TOKEN_LEN 16
+#define TOKEN_MAXLEN 64
+#define AUTH_TIMEOUT 10
+#define AUTH_MAXLEN 128
+
+// Directions offloaded to kernel TLS, see the TLS section
+#define KTLS_TX 0x01
+#define KTLS_RX 0x02
+
+// Detached sessions kept for resume, see the SESSION RESUME section
+#define RESUME_TOKEN_LEN 32
+#define RESUME_MAXSESSIONS 1024
+#define RESUME_GRACE 60
+
+// History log segments, see the MESSAGE HISTORY section
+#define HISTORY_SEGMENT_FMT "chatlite-%06u.log"
+#define HISTORY_SEGMENT_SIZE (64 * 1024 * 1024)
+#define HISTORY_SEGMENTS 4
+#define HISTORY_MAXLEN 65536
+#define HISTORY_DEFAULT 50
+#define HISTORY_REPLAY_CHUNK (64 * 1024)
+
+// Wire encodings of the messages sent to clients, see message_encode
+#define ENCODING_PLAIN 0
+#define ENCODING_DEFLATE 1
+#define ENCODING_WEBSOCKET 2
+#define ENCODINGS 3
+
+// WebSocket connections, see the WEBSOCKET section
+#define WS_MAXLEN (16 * 1024)
+#define WS_HANDSHAKE_MAXLEN 4096
+
+// Periodic state snapshots, see the STATE SNAPSHOTS section
+#define SNAPSHOT_PATH "chatlite.snap"
+#define SNAPSHOT_MAGIC "CLSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_INTERVAL 5
+
+// Hot upgrade handover, see the HOT UPGRADE section
+#define UPGRADE_MAGIC "CLUPGR"
+#define UPGRADE_VERSION 10
+
+// Max time given to clients to receive their pending data on shutdown
+#define DRAIN_TIMEOUT_MS 5000
+
+// Unsent bytes in the kernel above which a client socket stops being writable
+#define OUTQ_LOW_WATERMARK (16 * 1024)
+
+// Outbound lanes of a client, most urgent first, see client_write_lanes
+#define LANE_CONTROL 0
+#define LANE_LIVE 1
+#define LANE_NOTICE 2
+#define LANE_BULK 3
+#define LANES 4
+#define OUTQ_SHED (256 * 1024)
+
+// Memory charged to clients, see the MEMORY section
+#define CLIENT_MEM_MAX (8 * 1024 * 1024)
+#define MEM_MAX (1024 * 1024 * 1024)
+#define LANE_KEEP (64 * 1024)
+#define MEMORY_TOP 5
+
+// File transfers relayed through a pipe, see the FILE TRANSFER section
+#define TRANSFER_PIPE (1024 * 1024)
+#define TRANSFER_BUDGET (1024 * 1024)
+#define TRANSFER_IDLE 30
+
+// Event batches and read budgets, see the EVENT LOOP section
+#define LOOP_BATCH_MIN 8
+#define LOOP_BUCKETS 16
+#define READ_BUDGET (16 * 1024)
+#define BUSY_POLL 0
+#define LOOP_CPU -1
+#define FLUSH_CORK 0
+
+// Pause of the listeners when out of file descriptors, see accept_pause
+#define ACCEPT_BACKOFF_MS 100
+
+// Scratch memory of an iteration, see the SCRATCH ARENA section
+#define ARENA_BLOCK (16 * 1024)
+#define ARENA_BLOCK_MAX (1024 * 1024)
+#define ARENA_ALIGN 8
 
 // Return codes
 #define CL_OK 0
 #define CL_ERR -1
+#define CL_AGAIN 1
 
 // Debug logging
 #define CL_LOG(fmt, ...)                                                       \
@@ -64,28 +231,533 @@ void stderr_printf(const char *fmt, ...) {
 }
 
 /*
- * Let's use a global event based IO syscall
+ * Let's use a global event based IO syscall, `events` fits the max_events
+ * option
  */
 struct epoll_event ev;
-struct epoll_event events[MAX_EVENTS];
+struct epoll_event *events;
+
+/*
+ * Growable byte buffer, used to queue outgoing data that couldn't be written
+ * straight away on a client socket; `off` tracks how much of it has already
+ * been written.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t off;
+    size_t cap;
+} Buffer;
+
+/*
+ * Bump allocator for what only lives until the end of a loop iteration,
+ * see the SCRATCH ARENA section: `head` is the first block, kept across
+ * resets, `cur` the one allocations are carved from, the last of the
+ * chain, and `spills` counts the blocks chained after the first one
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t cap;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+    ArenaBlock *cur;
+    uint64_t spills;
+} Arena;
+
+/*
+ * An interned string, see the STRING INTERNING section: `str` is followed
+ * in memory by its wire header `<str>\r\n`, `next` chains the atoms of a
+ * hash bucket. `contact` is the presence state of a nick, see PRESENCE.
+ */
+typedef struct Atom {
+    struct Atom *next;
+    struct Contact *contact;
+    uint32_t hash;
+    uint32_t refs;
+    uint32_t len;
+    char str[];
+} Atom;
+
+typedef struct {
+    Atom *buckets[INTERN_BUCKETS];
+    uint32_t count;
+} Interns;
+
+// A small unordered set of atoms
+typedef struct {
+    Atom **items;
+    uint32_t len;
+    uint32_t cap;
+} AtomSet;
+
+/*
+ * Position of a client inside a history replay, frames in [next, end) are
+ * still to be sent and `sent` bytes of frame `next` already went out.
+ */
+typedef struct {
+    uint64_t next;
+    uint64_t end;
+    uint32_t sent;
+} HistoryCursor;
 
 /*
- * Simple client state, currently contains only the file descriptor and
- * the nickname set in the chat
+ * A file relayed from a client to another through a pipe, see FILE
+ * TRANSFER: `from` and `to` the fds of the two, -1 once gone, `size` the
+ * bytes announced, `left` the ones still to take in from the sender and
+ * `inpipe` the ones in the pipe. `accepted` is whether the recipient took
+ * it, `piece` the bytes of the piece being written out to it after the
+ * `head` header, `headsent` bytes of it out, and `active` the last time,
+ * in seconds, the file moved.
  */
 typedef struct {
+    int from;
+    int to;
+    int pipe[2];
+    uint64_t size;
+    uint64_t left;
+    size_t inpipe;
+    size_t piece;
+    uint8_t accepted;
+    uint8_t headlen;
+    uint8_t headsent;
+    uint32_t active;
+    char head[NICK_MAXLEN + 32];
+    char from_nick[NICK_MAXLEN];
+    char to_nick[NICK_MAXLEN];
+} Transfer;
+
+/*
+ * Simple client state, currently contains the file descriptor, the nickname
+ * set in the chat, pending output and the history replay cursor.
+ * `session` is the token to resume it after a disconnection, `synced` the
+ * id of the first chat message not yet handed to the kernel for it, i.e.
+ * where a resumed session picks up from; `queued` the id following the
+ * last one queued. `encoding` is the wire format of what's sent to it,
+ * `switching` the one it asked for, taken once all it was sent before is
+ * out, see client_switch, `in` the incomplete line last read from it, `out` its output by priority
+ * lane, `lane` the one being written and
+ * `left` the bytes of it to write before another lane can go, `transfer`
+ * the file it's sending or receiving. `mem` is the memory charged to it
+ * and `paused` whether it's not read because of it, see MEMORY.
+ * `next_nick` links the clients sharing its nick, see PRESENCE.
+ * `ready` is whether it's in the list of clients with input left over,
+ * linked through `next_ready`, `read_at` the iteration it was last read
+ * in, `dirty` whether it's in the list of clients with output to flush,
+ * linked through `prev_dirty` and `next_dirty`, see EVENT LOOP.
+ */
+typedef struct Client {
     int fd;
-    char nick[NICK_MAXLEN];
+    uint32_t events;
+    Atom *nick;
+    struct Client *next_nick;
+    uint8_t ready;
+    struct Client *next_ready;
+    uint64_t read_at;
+    uint8_t dirty;
+    struct Client *prev_dirty;
+    struct Client *next_dirty;
+    char session[RESUME_TOKEN_LEN + 1];
+    uint64_t synced;
+    uint64_t queued;
+    uint8_t encoding;
+    uint8_t switching;
+    Buffer in;
+    Buffer out[LANES];
+    int lane;
+    size_t left;
+    Transfer *transfer;
+    size_t mem;
+    uint8_t paused;
+    HistoryCursor replay;
 } Client;
 
+/*
+ * Presence of a nick: the clients using it and their number, the nicks
+ * it follows and the ones following it, i.e. the edges of the friends
+ * graph. `announced` is whether its watchers were last told it's online,
+ * `dirty` whether it's in the list of changes waiting to be flushed,
+ * linked through `next_dirty`.
+ */
+typedef struct Contact {
+    Atom *nick;
+    Client *clients;
+    uint32_t online;
+    uint8_t announced;
+    uint8_t dirty;
+    AtomSet friends;
+    AtomSet watchers;
+    struct Contact *next_dirty;
+} Contact;
+
+/*
+ * Presence changes not delivered yet, flushed at `deadline` (in ms), and
+ * counters of the updates delivered and of the changes folded into them
+ */
+typedef struct {
+    Contact *dirty;
+    int64_t deadline;
+    uint64_t updates;
+    uint64_t coalesced;
+} Presence;
+
+/*
+ * Join and leave notices waiting to be broadcast: the nicks that joined
+ * and left in the current window, which closes at `deadline` (in ms) and
+ * lasts `window` ms, `events` the joins and leaves seen during it; then
+ * counters of the notices sent and of the events they carried
+ */
+typedef struct {
+    AtomSet joined;
+    AtomSet left;
+    uint32_t events;
+    uint32_t window;
+    int64_t deadline;
+    uint64_t sent;
+    uint64_t total;
+} Notices;
+
+/*
+ * A link between two nodes, see the CLUSTER section: the frames received
+ * and not processed yet and the ones batched for the next write. `peer`
+ * is the node at the other end, -1 until an inbound link introduces
+ * itself, `up` whether an outbound one ever connected.
+ */
+typedef struct {
+    int fd;
+    int peer;
+    uint8_t outbound;
+    uint8_t up;
+    Buffer in;
+    Buffer out;
+} Link;
+
+/*
+ * Another node of the cluster: its address, which is also its id, the
+ * fd of the link messages are forwarded on, -1 while down, whether that
+ * link is up, whether it has members to forward to, the frames forwarded
+ * and the writes they took
+ */
+typedef struct {
+    char addr[NODE_MAXLEN];
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    int link;
+    uint8_t up;
+    uint8_t interested;
+    uint64_t frames;
+    uint64_t writes;
+} Peer;
+
+// A virtual node on the hash ring, `node` a peer index or -1 for this one
+typedef struct {
+    uint32_t hash;
+    int node;
+} RingPoint;
+
+typedef struct {
+    RingPoint points[(CLUSTER_MAXPEERS + 1) * RING_VNODES];
+    int len;
+} Ring;
+
+typedef struct {
+    uint64_t seq;
+    uint64_t id;
+} RoomEntry;
+
+/*
+ * A room as ordered by the cluster: its owner, a peer index or -1 for
+ * this node, the last sequence number assigned or seen, and the history
+ * ids of the last HANDOFF_MAX messages, `count` the messages recorded;
+ * `gaps` and `dups` count the sequence numbers received skipped or
+ * already seen, a sign of messages lost or of two nodes numbering them
+ */
+typedef struct {
+    int owner;
+    uint64_t seq;
+    uint64_t count;
+    uint64_t gaps;
+    uint64_t dups;
+    RoomEntry recent[HANDOFF_MAX];
+} Room;
+
+/*
+ * This node in the cluster: the listener for inbound links, -1 when not
+ * clustered, its address and its peers; `members` the local clients and
+ * `advertised` whether peers were last told there are some; the ring of
+ * the nodes up and the room it assigns an owner
+ */
+typedef struct {
+    int fd;
+    char node[NODE_MAXLEN];
+    Peer peers[CLUSTER_MAXPEERS];
+    int npeers;
+    uint32_t members;
+    uint8_t advertised;
+    Ring ring;
+    Room room;
+} Cluster;
+
+/*
+ * State of a WebSocket connection: whether the HTTP upgrade is done and
+ * the input not processed yet, the request or incomplete frames
+ */
+typedef struct {
+    uint8_t open;
+    Buffer in;
+} WsConn;
+
+/*
+ * A connection yet to authenticate: the time (in seconds) by which it must
+ * do it, 0 for unused slots, and the start of its auth line if that came
+ * in pieces
+ */
+typedef struct {
+    uint32_t deadline;
+    uint16_t len;
+    char line[AUTH_MAXLEN];
+} Preauth;
+
+/*
+ * A detached session, waiting to be resumed until `expires` (in seconds,
+ * 0 for free slots); `prev` and `next` link it in the LRU list, or in the
+ * free list.
+ */
+typedef struct {
+    char token[RESUME_TOKEN_LEN + 1];
+    char nick[NICK_MAXLEN];
+    uint64_t synced;
+    uint32_t expires;
+    int prev;
+    int next;
+} Session;
+
+/*
+ * Bounded LRU of detached sessions, most recently detached at `head`;
+ * when full the least recent one, at `tail`, is evicted
+ */
+typedef struct {
+    Session slots[RESUME_MAXSESSIONS];
+    int head;
+    int tail;
+    int free;
+} Sessions;
+
+/*
+ * Reference of a single frame stored on disk: the segment containing it,
+ * its offset and its length
+ */
+typedef struct {
+    uint32_t segment;
+    uint32_t len;
+    off_t offset;
+} HistoryEntry;
+
+/*
+ * On-disk message history
+ *  - fds the open segments, indexed by segment number % HISTORY_SEGMENTS
+ *  - segment the segment currently being appended to, size its size
+ *  - segment_max the size past which a segment is rotated
+ *  - first_id, next_id the range of frame ids still indexed
+ *  - entries a ring of HISTORY_MAXLEN entries, indexed by id % HISTORY_MAXLEN
+ */
+typedef struct {
+    int fds[HISTORY_SEGMENTS];
+    uint32_t segment;
+    off_t size;
+    off_t segment_max;
+    uint64_t first_id;
+    uint64_t next_id;
+    HistoryEntry *entries;
+} History;
+
+/*
+ * Memory held on behalf of the clients, see MEMORY: `used` the bytes
+ * charged to all of them, `over` whether some client or the total went
+ * over its cap since the last check, `pressure` whether the total is past
+ * the point where reads stop and `stuck` whether it was already at the
+ * last housekeeping, `paused` the clients not read and `evicted` the ones
+ * disconnected to stay under the caps
+ */
+typedef struct {
+    size_t used;
+    uint8_t over;
+    uint8_t pressure;
+    uint8_t stuck;
+    uint32_t paused;
+    uint64_t evicted;
+} Memory;
+
+/*
+ * Global counters, part of the snapshot so they survive restarts
+ */
+typedef struct {
+    uint64_t connections;
+    uint64_t messages;
+} Stats;
+
+/*
+ * Deflate stream shared by all the compressed connections and its counters:
+ * frames compressed and frames sent (a broadcast is compressed once for
+ * all the recipients), bytes before and after compression and the time
+ * spent compressing, in nanoseconds
+ */
+typedef struct {
+    z_stream zs;
+    uint32_t dict_id;
+    uint64_t frames;
+    uint64_t sent;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t ns;
+} Compressor;
+
+/*
+ * Background snapshot writer, the event loop hands over an encoded image
+ * of the state and the thread writes it to disk; `image` is NULL while
+ * the thread is idle.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *image;
+    size_t len;
+} Snapshotter;
+
+/*
+ * Event loop state, see the EVENT LOOP section: the iterations run and
+ * the waits that returned nothing, the current epoll batch size, the
+ * clients with input left for the next iteration, their number and the
+ * times one was left over, the clients with output to flush, the sends
+ * queued, the flushes they took and the notices shed, and a log2
+ * histogram of the iterations duration in microseconds
+ */
+typedef struct {
+    uint64_t iterations;
+    uint64_t idle;
+    int batch;
+    Client *ready;
+    Client *ready_tail;
+    int nready;
+    uint64_t requeued;
+    Client *dirty;
+    uint64_t sends;
+    uint64_t flushes;
+    uint64_t shed;
+    uint64_t durations[LOOP_BUCKETS];
+} Loop;
+
+/*
+ * Runtime configuration, see the CONFIGURATION section: where to listen,
+ * the table sizes and the tunables of the subsystems, each named after
+ * the define holding its default
+ */
+typedef struct {
+    char addr[INET6_ADDRSTRLEN];
+    int port;
+    int ws_port;
+    char unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int backlog;
+    int max_clients;
+    char token[TOKEN_MAXLEN + 1];
+    char cluster[NODE_MAXLEN];
+    char peers[CLUSTER_MAXPEERS * NODE_MAXLEN];
+    int max_events;
+    int read_budget;
+    int busy_poll;
+    int cpu;
+    int cork;
+    int nick_maxlen;
+    int auth_timeout;
+    int resume_grace;
+    int history_default;
+    int history_replay_chunk;
+    int history_segment_size;
+    int outq_low_watermark;
+    int outq_shed;
+    int client_mem_max;
+    int mem_max;
+    int link_maxpending;
+    int snapshot_interval;
+    int drain_timeout_ms;
+    int transfer_idle;
+    int friends_max;
+    int presence_interval;
+    int notices_window;
+    int notices_window_max;
+    int notices_burst;
+} Config;
+
 /*
  * A basic server state
- *  - fd the file descriptor it listens on
- *  - clients an array of file descriptors representing client connections
+ *  - config the runtime configuration
+ *  - fd the file descriptor it listens on, ws_fd the WebSocket one,
+ *    unix_fd the Unix socket one, -1 if disabled
+ *  - epollfd the event loop descriptor
+ *  - timerfd periodic timer driving housekeeping, e.g. snapshots
+ *  - sigfd signals handled by the event loop, e.g. SIGUSR2 to upgrade
+ *  - loop the event loop batching and timings
+ *  - memory the memory charged to clients
+ *  - scratch what's formatted while handling an iteration, see SCRATCH ARENA
+ *  - drain_deadline when draining, the time by which the process exits
+ *  - accept_resume when out of file descriptors, the time the listeners
+ *    are polled again, 0 while they are
+ *  - token the secret clients must present to be admitted
+ *  - clients an array of file descriptors representing client connections,
+ *    like all the tables indexed by fd it has config.max_clients slots
+ *  - ws WebSocket connections state, indexed by fd, NULL for raw TCP ones
+ *  - cluster the other nodes, links the links to them indexed by fd
+ *  - interns the interned strings, commands and server_nick the atoms of
+ *    the command names and of the sender of server notices
+ *  - preauth connections yet to authenticate, indexed by fd
+ *  - sessions detached sessions that can be resumed
+ *  - presence the presence changes waiting to be delivered
+ *  - notices the join and leave notices waiting to be broadcast
+ *  - history the chat messages log
+ *  - stats global counters
+ *  - compressor the deflate state for compressed connections
+ *  - snapshotter the background snapshot writer
+ *  - tls_ctx, tls when built with TLS, the context and the sessions of TLS
+ *    connections indexed by fd, ktls the directions offloaded to the kernel
  */
 typedef struct {
+    Config config;
     int fd;
-    Client *clients[MAX_CLIENTS];
+    int ws_fd;
+    int unix_fd;
+    int epollfd;
+    int timerfd;
+    int sigfd;
+    Loop loop;
+    Memory memory;
+    Arena scratch;
+    int64_t drain_deadline;
+    int64_t accept_resume;
+    char token[TOKEN_MAXLEN + 1];
+    Client **clients;
+    WsConn **ws;
+    Cluster cluster;
+    Link **links;
+    Interns interns;
+    Atom *commands[CMDS];
+    Atom *server_nick;
+    Preauth *preauth;
+    Sessions sessions;
+    Presence presence;
+    Notices notices;
+    History history;
+    Stats stats;
+    Compressor compressor;
+    Snapshotter snapshotter;
+#ifdef HAVE_TLS
+    SSL_CTX *tls_ctx;
+    SSL **tls;
+    uint8_t *ktls;
+#endif
 } Server;
 
 /*
@@ -101,6 +773,45 @@ void *cl_malloc(size_t size) {
     return ptr;
 }
 
+void *cl_calloc(size_t n, size_t size) {
+    void *ptr = calloc(n, size);
+    if (ptr == NULL) {
+        perror("Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+void *cl_realloc(void *ptr, size_t size) {
+    ptr = realloc(ptr, size);
+    if (ptr == NULL) {
+        perror("Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+// Monotonic clock in milliseconds
+int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Monotonic clock in nanoseconds
+int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The earliest of two epoll_wait timeouts, -1 meaning none
+int timeout_min(int a, int b) {
+    if (a < 0)
+        return b;
+    return b >= 0 && b < a ? b : a;
+}
+
 char *trim_string(char *str) {
     char *end;
 
@@ -122,277 +833,5270 @@ char *trim_string(char *str) {
     return str;
 }
 
-void generate_random_token(char token[16]) {
-    int urandom = open("/dev/urandom", O_RDONLY);
-    if (urandom < 0) {
-        perror("urandom");
-        // Panic for now
-        exit(EXIT_FAILURE);
+/*
+ * Fill buf with cryptographically secure random bytes. They're drawn from
+ * the kernel with getrandom(2) a pool at a time, so minting a token is
+ * usually just a memcpy; bytes are wiped from the pool once handed out.
+ */
+void random_bytes(void *buf, size_t len) {
+    static unsigned char pool[256];
+    static size_t pos = 0, end = 0;
+    unsigned char *dst = buf;
+    while (len > 0) {
+        if (pos == end) {
+            ssize_t n = getrandom(pool, sizeof(pool), 0);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("getrandom");
+                // Panic for now
+                exit(EXIT_FAILURE);
+            }
+            pos = 0;
+            end = n;
+        }
+        size_t chunk = len < end - pos ? len : end - pos;
+        memcpy(dst, pool + pos, chunk);
+        memset(pool + pos, 0x00, chunk);
+        pos += chunk;
+        dst += chunk;
+        len -= chunk;
     }
-    char random_data[16];
-    ssize_t result = read(urandom, random_data, sizeof(random_data));
-    if (result < 0) {
-        perror("reading urandom");
-        // Panic for now`
-        exit(EXIT_FAILURE);
+}
+
+// Generate a random token of `len` hex chars, `token` must fit len + 1
+void generate_random_token(char *token, size_t len) {
+    static const char hex[] = "0123456789ABCDEF";
+    unsigned char random_data[TOKEN_MAXLEN / 2];
+    random_bytes(random_data, (len + 1) / 2);
+    for (size_t i = 0; i < len; i++)
+        token[i] = hex[(random_data[i / 2] >> (i % 2 ? 0 : 4)) & 0x0F];
+    token[len] = '\0';
+}
+
+/*
+ * Compare two secrets of the same length in constant time, not leaking
+ * the position of the first mismatch through the timing
+ */
+int token_equal(const char *a, const char *b, size_t len) {
+    unsigned char diff = 0;
+    for (size_t i = 0; i < len; i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+static void buffer_append(Buffer *b, const char *data, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap < b->len + len)
+            cap *= 2;
+        b->data = cl_realloc(b->data, cap);
+        b->cap = cap;
     }
-    token[15] = 0;
-    for (int i = 0; i < 8; i++)
-        sprintf(&token[2 * i], "%02X", random_data[i]);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
 }
 
+static inline size_t buffer_pending(const Buffer *b) { return b->len - b->off; }
+
 /*
  * =====================================================
- *                 NETWORKING HELPERS
+ *                 SCRATCH ARENA
  * =====================================================
  *
- * This server will adopt a simple text protocol TCP-based; to manage
- * the communication, we're defining a couple of useful helpers to
- * create a connection (TCP stream) and to read and write data from a
- * connected stream.
+ * Messages, frames and replies formatted while handling an iteration only
+ * live until they're copied to the output lanes, the links or the history,
+ * all done by the flush closing the iteration. They're carved out of
+ * `server->scratch` with a pointer bump, sized to what they actually hold,
+ * and released all at once when the iteration ends: no fixed size array
+ * cutting a long message short, and no malloc on the hot path.
  *
- * - listen;
- * - accept;
- * - set_nonblocking; useful to leverage EPOLL (or SELECT/POLL, KQUEUE
- *   on BSD-like systems) and perform non-blocking reads/writes
- * - read
- * - write
+ * What doesn't fit the first block goes to blocks chained after it, freed
+ * by the reset, which also regrows the first block to the peak, up to
+ * ARENA_BLOCK_MAX, so that the next iterations like this one don't spill.
+ * Nothing allocated from the arena may be kept across iterations.
  */
 
-/* Set non-blocking socket */
-static int set_nonblocking(int fd) {
-    int flags, result;
-    flags = fcntl(fd, F_GETFL, 0);
-
-    if (flags == -1)
-        goto err;
-
-    result = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-    if (result == -1)
-        goto err;
+static ArenaBlock *arena_block(size_t cap) {
+    ArenaBlock *b = cl_malloc(sizeof(ArenaBlock) + cap);
+    *b = (ArenaBlock){.cap = cap};
+    return b;
+}
 
-    return CL_OK;
+// Chain a block of at least `size` bytes after the current one
+static ArenaBlock *arena_spill(Arena *a, size_t size) {
+    ArenaBlock *b = arena_block(size > ARENA_BLOCK ? size : ARENA_BLOCK);
+    if (a->head == NULL) {
+        a->head = b;
+    } else {
+        a->cur->next = b;
+        a->spills++;
+    }
+    a->cur = b;
+    return b;
+}
 
-err:
+// `size` bytes, ARENA_ALIGN aligned, valid until the next arena_reset
+static void *arena_alloc(Arena *a, size_t size) {
+    ArenaBlock *b = a->cur;
+    size_t off = 0;
+    if (b)
+        off = (b->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (b == NULL || off + size > b->cap) {
+        b = arena_spill(a, size);
+        off = 0;
+    }
+    b->used = off + size;
+    return b->data + off;
+}
 
-    fprintf(stderr, "set_nonblocking: %s\n", strerror(errno));
-    return CL_ERR;
+/*
+ * Append formatted text to the string `str`, `*len` bytes long, or start
+ * a new one if it's NULL; returns the string, nul terminated, and updates
+ * `*len`. The string grows in place while it's the last allocation and
+ * its block has room, it's moved to a bigger one otherwise.
+ */
+static char *arena_catf(Arena *a, char *str, size_t *len, const char *fmt,
+                        ...) {
+    va_list ap;
+    if (str == NULL) {
+        str = arena_alloc(a, 1);
+        *len = 0;
+    }
+    assert(str + *len + 1 == a->cur->data + a->cur->used);
+    size_t room = a->cur->cap - (str + *len - a->cur->data);
+    va_start(ap, fmt);
+    int n = vsnprintf(str + *len, room, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        n = 0;
+    if ((size_t)n >= room) {
+        char *moved = arena_alloc(a, *len + n + 1);
+        memcpy(moved, str, *len);
+        str = moved;
+        va_start(ap, fmt);
+        vsnprintf(str + *len, n + 1, fmt, ap);
+        va_end(ap);
+    }
+    str[*len + n] = '\0';
+    *len += n;
+    a->cur->used = str + *len + 1 - a->cur->data;
+    return str;
 }
 
-static int cl_listen(Server *server, const char *host, int port, int backlog) {
+// Release everything allocated since the last reset
+static void arena_reset(Arena *a) {
+    ArenaBlock *head = a->head;
+    if (head == NULL)
+        return;
+    size_t spilled = 0;
+    for (ArenaBlock *b = head->next, *next; b; b = next) {
+        next = b->next;
+        spilled += b->used;
+        free(b);
+    }
+    head->next = NULL;
+    head->used = 0;
+    if (spilled > 0 && head->cap < ARENA_BLOCK_MAX) {
+        size_t cap = head->cap;
+        while (cap < head->cap + spilled && cap < ARENA_BLOCK_MAX)
+            cap *= 2;
+        free(head);
+        head = a->head = arena_block(cap);
+    }
+    a->cur = head;
+}
 
-    int listen_fd = -1;
-    const struct addrinfo hints = {.ai_family = AF_UNSPEC,
-                                   .ai_socktype = SOCK_STREAM,
-                                   .ai_flags = AI_PASSIVE};
-    struct addrinfo *result, *rp;
-    char port_str[6];
+/*
+ * =====================================================
+ *                 STRING INTERNING
+ * =====================================================
+ *
+ * Strings the server keeps comparing and writing out, like nicks, command
+ * names and room names, are interned: a single refcounted copy of each
+ * lives in a hash table, so equality is a pointer comparison and lengths
+ * are never recomputed. Every atom also carries its wire header,
+ * `<string>\r\n`, so a message from a nick is framed with a couple of
+ * memcpy.
+ */
 
-    snprintf(port_str, 6, "%i", port);
+// FNV-1a
+static uint32_t intern_hash(const char *str, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-    if (getaddrinfo(host, port_str, &hints, &result) != 0)
-        goto err;
+static inline const char *atom_header(const Atom *a) {
+    return a->str + a->len + 1;
+}
 
-    /* Create a listening socket */
-    for (rp = result; rp != NULL; rp = rp->ai_next) {
-        listen_fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (listen_fd < 0)
-            continue;
+static inline size_t atom_header_len(const Atom *a) { return a->len + 2; }
 
-        /* set SO_REUSEADDR so the socket will be reusable after process kill */
-        if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1},
-                       sizeof(int)) < 0)
-            goto err;
+// The atom for a string if it's interned, NULL otherwise
+static Atom *atom_lookup(const Interns *t, const char *str, size_t len) {
+    uint32_t hash = intern_hash(str, len);
+    for (Atom *a = t->buckets[hash % INTERN_BUCKETS]; a; a = a->next)
+        if (a->hash == hash && a->len == len && memcmp(a->str, str, len) == 0)
+            return a;
+    return NULL;
+}
 
-        /* Bind it to the addr:port opened on the network interface */
-        if (bind(listen_fd, rp->ai_addr, rp->ai_addrlen) == 0)
-            break; // Succesful bind
-        close(listen_fd);
+// Take a reference to the atom for a string, interning it if needed
+static Atom *intern(Interns *t, const char *str, size_t len) {
+    Atom *a = atom_lookup(t, str, len);
+    if (a) {
+        a->refs++;
+        return a;
     }
 
-    freeaddrinfo(result);
-    if (rp == NULL)
-        goto err;
+    // The string, its terminator, then the header
+    a = cl_malloc(sizeof(Atom) + 2 * len + 3);
+    a->hash = intern_hash(str, len);
+    a->contact = NULL;
+    a->refs = 1;
+    a->len = len;
+    memcpy(a->str, str, len);
+    a->str[len] = '\0';
+    memcpy(a->str + len + 1, str, len);
+    memcpy(a->str + 2 * len + 1, "\r\n", 2);
 
-    /*
-     * Let's make the socket non-blocking (strongly advised to use the
-     * eventloop)
-     */
-    (void)set_nonblocking(listen_fd);
+    Atom **bucket = &t->buckets[a->hash % INTERN_BUCKETS];
+    a->next = *bucket;
+    *bucket = a;
+    t->count++;
+    return a;
+}
 
-    /* Finally let's make it listen */
-    if (listen(listen_fd, backlog) != 0)
-        goto err;
+static void atom_release(Interns *t, Atom *a) {
+    if (--a->refs > 0)
+        return;
+    Atom **p = &t->buckets[a->hash % INTERN_BUCKETS];
+    while (*p != a)
+        p = &(*p)->next;
+    *p = a->next;
+    t->count--;
+    free(a);
+}
 
-    server->fd = listen_fd;
+static int atomset_find(const AtomSet *s, const Atom *a) {
+    for (uint32_t i = 0; i < s->len; i++)
+        if (s->items[i] == a)
+            return i;
+    return -1;
+}
 
+static void atomset_add(AtomSet *s, Atom *a) {
+    if (atomset_find(s, a) >= 0)
+        return;
+    if (s->len == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4;
+        s->items = cl_realloc(s->items, s->cap * sizeof(Atom *));
+    }
+    s->items[s->len++] = a;
+}
+
+static void atomset_remove(AtomSet *s, const Atom *a) {
+    int i = atomset_find(s, a);
+    if (i >= 0)
+        s->items[i] = s->items[--s->len];
+}
+
+/*
+ * =====================================================
+ *                 TLS
+ * =====================================================
+ *
+ * When built with TLS=1 and started with CHATLITE_TLS_CERT and
+ * CHATLITE_TLS_KEY pointing to a PEM certificate chain and key, the
+ * listener speaks TLS. OpenSSL only drives the handshake: right after it
+ * the record layer is handed to the kernel (TCP_ULP "tls") where that's
+ * supported, so sends stay plain write and sendfile calls and history
+ * replay is still zero-copy. Connections that can't be offloaded go
+ * through SSL_read and SSL_write, history is then read from the segments
+ * and encrypted in userspace.
+ *
+ * All socket I/O goes through cl_read, cl_write and cl_sendfile, which are
+ * just the plain syscalls for anything not going through OpenSSL.
+ */
+
+#ifdef HAVE_TLS
+
+static int tls_init(Server *server) {
+    const char *cert = getenv("CHATLITE_TLS_CERT");
+    const char *key = getenv("CHATLITE_TLS_KEY");
+    if (cert == NULL || key == NULL)
+        return CL_OK;
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL)
+        goto err;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    // Make SSL_write behave like write(2) on non-blocking sockets
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                              SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1)
+        goto err;
+
+    server->tls_ctx = ctx;
+    CL_LOG("TLS enabled with %s\n", cert);
+    return CL_OK;
+
+err:
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    return CL_ERR;
+}
+
+static int tls_accept(Server *server, int fd) {
+    SSL *ssl = SSL_new(server->tls_ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, fd) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return CL_ERR;
+    }
+    SSL_set_accept_state(ssl);
+    server->tls[fd] = ssl;
+    server->ktls[fd] = 0;
+    return CL_OK;
+}
+
+static void tls_free(Server *server, int fd) {
+    SSL_free(server->tls[fd]);
+    server->tls[fd] = NULL;
+    server->ktls[fd] = 0;
+}
+
+static inline int tls_handshaking(const Server *server, int fd) {
+    return server->tls[fd] && !SSL_is_init_finished(server->tls[fd]);
+}
+
+/*
+ * Move the handshake forward, waiting for the socket to be writable too if
+ * OpenSSL asks for it. Once done, check which directions the kernel took
+ * over. Returns CL_OK when done, CL_AGAIN while still in progress.
+ */
+static int tls_handshake(Server *server, int fd) {
+    SSL *ssl = server->tls[fd];
+    int rc = SSL_do_handshake(ssl);
+    uint32_t events = EPOLLIN;
+    if (rc != 1) {
+        int err = SSL_get_error(ssl, rc);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+            ERR_clear_error();
+            return CL_ERR;
+        }
+        if (err == SSL_ERROR_WANT_WRITE)
+            events |= EPOLLOUT;
+    }
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(server->epollfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+        perror("epoll_ctl: client fd");
+    if (rc != 1)
+        return CL_AGAIN;
+
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+        server->ktls[fd] |= KTLS_TX;
+    if (BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+        server->ktls[fd] |= KTLS_RX;
+    CL_LOG("TLS handshake fd=%i %s, kTLS tx %s rx %s\n", fd,
+           SSL_get_version(ssl), server->ktls[fd] & KTLS_TX ? "on" : "off",
+           server->ktls[fd] & KTLS_RX ? "on" : "off");
+    return CL_OK;
+}
+
+// The SSL session, if the record layer for `dir` is in userspace
+static inline SSL *tls_userspace(const Server *server, int fd, uint8_t dir) {
+    return server->tls[fd] && !(server->ktls[fd] & dir) ? server->tls[fd]
+                                                        : NULL;
+}
+
+// Map an SSL_read/SSL_write failure to the read/write(2) semantics
+static ssize_t tls_result(SSL *ssl, int rc) {
+    switch (SSL_get_error(ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    default:
+        ERR_clear_error();
+        errno = EIO;
+        return -1;
+    }
+}
+
+#endif
+
+static ssize_t cl_read(Server *server, int fd, void *buf, size_t len) {
+#ifdef HAVE_TLS
+    SSL *ssl = tls_userspace(server, fd, KTLS_RX);
+    if (ssl) {
+        int n = SSL_read(ssl, buf, len);
+        return n > 0 ? n : tls_result(ssl, n);
+    }
+#else
+    (void)server;
+#endif
+    return read(fd, buf, len);
+}
+
+static ssize_t cl_write(Server *server, int fd, const void *buf, size_t len) {
+#ifdef HAVE_TLS
+    SSL *ssl = tls_userspace(server, fd, KTLS_TX);
+    if (ssl) {
+        int n = SSL_write(ssl, buf, len);
+        return n > 0 ? n : tls_result(ssl, n);
+    }
+#else
+    (void)server;
+#endif
+    return write(fd, buf, len);
+}
+
+static ssize_t cl_sendfile(Server *server, int fd, int in, off_t *offset,
+                           size_t count) {
+#ifdef HAVE_TLS
+    SSL *ssl = tls_userspace(server, fd, KTLS_TX);
+    if (ssl) {
+        char chunk[16 * 1024];
+        size_t len = count < sizeof(chunk) ? count : sizeof(chunk);
+        ssize_t n = pread(in, chunk, len, *offset);
+        if (n <= 0)
+            return n;
+        int w = SSL_write(ssl, chunk, n);
+        if (w <= 0)
+            return tls_result(ssl, w);
+        *offset += w;
+        return w;
+    }
+#else
+    (void)server;
+#endif
+    return sendfile(fd, in, offset, count);
+}
+
+/*
+ * =====================================================
+ *                 COMPRESSION
+ * =====================================================
+ *
+ * A client can ask for its output to be compressed with
+ *
+ * /compress deflate <dictionary id>
+ *
+ * the id being the adler32, in hex, of its copy of the dictionary shipped
+ * in chatlite_dict.h. If it matches, once everything already queued for
+ * the client is out, the server acks with a last plain
+ * `Server\r\nCompression on\n` and from then on every message goes out as
+ * a frame: 2 bytes of big-endian length followed by the message deflated
+ * on its own (raw deflate, no zlib header) with the dictionary preset.
+ *
+ * Messages are compressed independently rather than as a stream per
+ * connection: a bit of ratio is lost, the dictionary making up for most of
+ * the missing context, but a frame is then the same for every recipient,
+ * a broadcast is compressed once however many clients get it and history
+ * replay can compress entries as it reads them.
+ */
+
+static int compress_init(Compressor *z) {
+    // The stream is reset on every message, which clears the hash table,
+    // kept small, but not the window: the largest one keeps the dictionary
+    // in reach from anywhere in a LINE_MAXLEN message
+    if (deflateInit2(&z->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 2,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2: %s\n", z->zs.msg ? z->zs.msg : "error");
+        return CL_ERR;
+    }
+    z->dict_id = adler32(adler32(0, Z_NULL, 0), (const Bytef *)chatlite_dict,
+                         sizeof(chatlite_dict) - 1);
+    return CL_OK;
+}
+
+/*
+ * Compress a message into a frame of `cap` bytes, returns the frame length
+ * or 0 if it doesn't fit
+ */
+static size_t compress_frame(Compressor *z, const char *msg, size_t len,
+                             char *frame, size_t cap) {
+    int64_t start = now_ns();
+    z_stream *zs = &z->zs;
+    deflateReset(zs);
+    deflateSetDictionary(zs, (const Bytef *)chatlite_dict,
+                         sizeof(chatlite_dict) - 1);
+    zs->next_in = (Bytef *)msg;
+    zs->avail_in = len;
+    zs->next_out = (Bytef *)frame + 2;
+    zs->avail_out = cap - 2;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END)
+        return 0;
+
+    size_t n = zs->total_out;
+    if (n > 0xFFFF)
+        return 0;
+    frame[0] = n >> 8;
+    frame[1] = n & 0xFF;
+    z->frames++;
+    z->bytes_in += len;
+    z->bytes_out += n + 2;
+    z->ns += now_ns() - start;
+    return n + 2;
+}
+
+/*
+ * =====================================================
+ *                 WEBSOCKET
+ * =====================================================
+ *
+ * Browsers connect on WS_PORT, the listener lives in the same event loop
+ * as the TCP one. Once the HTTP upgrade is done a connection goes through
+ * authentication and commands like any other, messages are simply carried
+ * in frames:
+ *
+ * - every text (or binary) message received is a line of the raw protocol,
+ *   the trailing newline being optional
+ * - every message sent is a text frame holding the usual
+ *   `<nick>\r\n<message>\n`
+ *
+ * so the internal representation stays the same and a broadcast is framed
+ * once for all the WebSocket clients. Fragmented messages aren't
+ * supported, browsers don't fragment messages as short as chat lines.
+ */
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_TEXT 0x1
+#define WS_BINARY 0x2
+#define WS_CLOSE 0x8
+#define WS_PING 0x9
+#define WS_PONG 0xA
+
+#define ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+// Just for the handshake, computing Sec-WebSocket-Accept
+static void sha1(const void *data, size_t len, uint8_t digest[20]) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                     0xC3D2E1F0};
+    const uint8_t *p = data;
+    uint64_t bits = (uint64_t)len * 8;
+    size_t total = ((len + 8) / 64 + 1) * 64;
+
+    for (size_t off = 0; off < total; off += 64) {
+        uint8_t block[64];
+        for (size_t i = 0; i < 64; i++) {
+            size_t pos = off + i;
+            if (pos < len)
+                block[i] = p[pos];
+            else if (pos == len)
+                block[i] = 0x80;
+            else if (pos >= total - 8)
+                block[i] = bits >> (8 * (total - 1 - pos));
+            else
+                block[i] = 0;
+        }
+
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)block[4 * i] << 24 |
+                   (uint32_t)block[4 * i + 1] << 16 |
+                   (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+        for (int i = 16; i < 80; i++)
+            w[i] = ROTL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = ROTL(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = ROTL(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    for (int i = 0; i < 20; i++)
+        digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+// Encode len bytes in base64, `out` must fit 4 * ((len + 2) / 3) + 1
+static void base64_encode(const uint8_t *in, size_t len, char *out) {
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t j = 0;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = (uint32_t)in[i] << 16;
+        if (i + 1 < len)
+            v |= (uint32_t)in[i + 1] << 8;
+        if (i + 2 < len)
+            v |= in[i + 2];
+        out[j++] = table[(v >> 18) & 0x3F];
+        out[j++] = table[(v >> 12) & 0x3F];
+        out[j++] = i + 1 < len ? table[(v >> 6) & 0x3F] : '=';
+        out[j++] = i + 2 < len ? table[v & 0x3F] : '=';
+    }
+    out[j] = '\0';
+}
+
+static void ws_accept(Server *server, int fd) {
+    WsConn *ws = cl_malloc(sizeof(WsConn));
+    *ws = (WsConn){0};
+    server->ws[fd] = ws;
+}
+
+static void ws_free(Server *server, int fd) {
+    if (server->ws[fd] == NULL)
+        return;
+    free(server->ws[fd]->in.data);
+    free(server->ws[fd]);
+    server->ws[fd] = NULL;
+}
+
+/*
+ * Write a frame header followed by `len` bytes of payload into frame, which
+ * must fit len + 4 bytes (payloads are never longer than 64K). Returns the
+ * length of the frame.
+ */
+static size_t ws_frame(uint8_t opcode, const char *payload, size_t len,
+                       char *frame) {
+    size_t hdr = 2;
+    frame[0] = 0x80 | opcode;
+    if (len < 126) {
+        frame[1] = len;
+    } else {
+        frame[1] = 126;
+        frame[2] = len >> 8;
+        frame[3] = len & 0xFF;
+        hdr = 4;
+    }
+    memcpy(frame + hdr, payload, len);
+    return hdr + len;
+}
+
+/*
+ * Answer the HTTP upgrade request buffered, returns CL_AGAIN until it's
+ * complete, CL_ERR if it's not a valid one
+ */
+static int ws_handshake(Server *server, int fd) {
+    WsConn *ws = server->ws[fd];
+    const char *end = memmem(ws->in.data, ws->in.len, "\r\n\r\n", 4);
+    if (end == NULL)
+        return ws->in.len < WS_HANDSHAKE_MAXLEN ? CL_AGAIN : CL_ERR;
+
+    char request[WS_HANDSHAKE_MAXLEN + 1];
+    size_t len = end - ws->in.data;
+    memcpy(request, ws->in.data, len);
+    request[len] = '\0';
+    ws->in.off = len + 4;
+
+    const char *key = strcasestr(request, "\r\nSec-WebSocket-Key:");
+    size_t key_len = 0;
+    if (key != NULL) {
+        key += 20;
+        while (*key == ' ')
+            key++;
+        key_len = strcspn(key, " \r");
+    }
+    if (strncmp(request, "GET ", 4) != 0 || key_len == 0 || key_len > 64) {
+        const char *bad = "HTTP/1.1 400 Bad Request\r\n\r\n";
+        (void)cl_write(server, fd, bad, strlen(bad));
+        return CL_ERR;
+    }
+
+    char accept_src[64 + sizeof(WS_GUID)], accept[29];
+    uint8_t digest[20];
+    memcpy(accept_src, key, key_len);
+    memcpy(accept_src + key_len, WS_GUID, sizeof(WS_GUID));
+    sha1(accept_src, key_len + sizeof(WS_GUID) - 1, digest);
+    base64_encode(digest, sizeof(digest), accept);
+
+    char response[256];
+    int n = snprintf(response, sizeof(response),
+                     "HTTP/1.1 101 Switching Protocols\r\n"
+                     "Upgrade: websocket\r\n"
+                     "Connection: Upgrade\r\n"
+                     "Sec-WebSocket-Accept: %s\r\n\r\n",
+                     accept);
+    if (cl_write(server, fd, response, n) != n)
+        return CL_ERR;
+    ws->open = 1;
+    return CL_OK;
+}
+
+/*
+ * Consume the next frame buffered: a data message is unmasked into msg,
+ * newline terminated, `len` set to its length; control frames get their
+ * answer appended to `reply` and `len` set to 0. Returns CL_AGAIN if the
+ * frame isn't complete yet, CL_ERR when the connection has to be closed.
+ */
+static int ws_parse(WsConn *ws, char *msg, size_t cap, size_t *len,
+                    Buffer *reply) {
+    uint8_t *p = (uint8_t *)ws->in.data + ws->in.off;
+    size_t avail = buffer_pending(&ws->in);
+    if (avail < 2)
+        return CL_AGAIN;
+
+    // Frames from clients are always masked
+    uint8_t fin = p[0] & 0x80, opcode = p[0] & 0x0F;
+    if (!(p[1] & 0x80))
+        return CL_ERR;
+    uint64_t plen = p[1] & 0x7F;
+    size_t hdr = 2;
+    if (plen == 126) {
+        if (avail < 4)
+            return CL_AGAIN;
+        plen = (uint64_t)p[2] << 8 | p[3];
+        hdr = 4;
+    } else if (plen == 127) {
+        if (avail < 10)
+            return CL_AGAIN;
+        plen = 0;
+        for (int i = 0; i < 8; i++)
+            plen = plen << 8 | p[2 + i];
+        hdr = 10;
+    }
+    if (plen > WS_MAXLEN)
+        return CL_ERR;
+    if (avail < hdr + 4 + plen)
+        return CL_AGAIN;
+
+    const uint8_t *mask = p + hdr;
+    char *payload = (char *)p + hdr + 4;
+    for (size_t i = 0; i < plen; i++)
+        payload[i] ^= mask[i % 4];
+    ws->in.off += hdr + 4 + plen;
+
+    char frame[WS_MAXLEN + 4];
+    *len = 0;
+    switch (opcode) {
+    case WS_TEXT:
+    case WS_BINARY:
+        if (!fin)
+            return CL_ERR;
+        if (plen > cap - 2)
+            plen = cap - 2;
+        memcpy(msg, payload, plen);
+        if (plen == 0 || msg[plen - 1] != '\n')
+            msg[plen++] = '\n';
+        msg[plen] = '\0';
+        *len = plen;
+        return CL_OK;
+    case WS_PING:
+        buffer_append(reply, frame, ws_frame(WS_PONG, payload, plen, frame));
+        return CL_OK;
+    case WS_PONG:
+        return CL_OK;
+    case WS_CLOSE:
+        // Echo the status code, if any
+        buffer_append(reply, frame,
+                      ws_frame(WS_CLOSE, payload, plen < 2 ? plen : 2, frame));
+        return CL_ERR;
+    default:
+        return CL_ERR;
+    }
+}
+
+/*
+ * Next message received on a WebSocket connection, going through the
+ * upgrade first; the socket is only read when no complete frame is
+ * buffered, so at most WS_MAXLEN bytes of input are held. Answers to
+ * control frames are appended to `reply` for the caller to send. Returns
+ * the length of the message stored in msg, 0 if none is complete yet and
+ * -1 if the connection has to be closed.
+ */
+static ssize_t ws_recv(Server *server, int fd, char *msg, size_t cap,
+                       Buffer *reply) {
+    WsConn *ws = server->ws[fd];
+    for (;;) {
+        int rc = CL_AGAIN;
+        size_t len = 0;
+        if (!ws->open)
+            rc = ws_handshake(server, fd);
+        else if (buffer_pending(&ws->in) > 0)
+            rc = ws_parse(ws, msg, cap, &len, reply);
+        if (rc == CL_ERR)
+            return -1;
+        if (rc == CL_OK) {
+            if (len > 0)
+                return len;
+            continue;
+        }
+
+        // Keep only the incomplete frame and read some more
+        memmove(ws->in.data, ws->in.data + ws->in.off,
+                buffer_pending(&ws->in));
+        ws->in.len -= ws->in.off;
+        ws->in.off = 0;
+        if (ws->in.len >= WS_MAXLEN + 14)
+            return -1;
+        char chunk[4096];
+        ssize_t n = cl_read(server, fd, chunk, sizeof(chunk));
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        buffer_append(&ws->in, chunk, n);
+    }
+}
+
+/*
+ * Encode a message in the wire format of the given encoding, the frame is
+ * allocated from the scratch arena unless the encoding is the plain one;
+ * returns it and sets its length in `framelen`, or NULL on error
+ */
+static const char *message_encode(Server *server, uint8_t encoding,
+                                  const char *msg, size_t len,
+                                  size_t *framelen) {
+    char *frame;
+    size_t cap;
+    switch (encoding) {
+    case ENCODING_DEFLATE:
+        cap = deflateBound(&server->compressor.zs, len) + 2;
+        frame = arena_alloc(&server->scratch, cap);
+        *framelen =
+            compress_frame(&server->compressor, msg, len, frame, cap);
+        return *framelen > 0 ? frame : NULL;
+    case ENCODING_WEBSOCKET:
+        frame = arena_alloc(&server->scratch, len + 4);
+        *framelen = ws_frame(WS_TEXT, msg, len, frame);
+        return frame;
+    default:
+        *framelen = len;
+        return msg;
+    }
+}
+
+/*
+ * =====================================================
+ *                 MESSAGE HISTORY
+ * =====================================================
+ *
+ * Every chat message broadcast is also appended to an on-disk log, split in
+ * fixed size segments, using exactly the encoding clients receive on the
+ * wire (<nick>\r\n<message>). This way a replay never goes through
+ * userspace: the byte range of the requested frames is sendfile'd straight
+ * from the segment into the client socket, as fast as the socket accepts
+ * it.
+ *
+ * An in-memory ring indexes the most recent HISTORY_MAXLEN frames by id.
+ * Only the last HISTORY_SEGMENTS segments are kept, older ones are unlinked
+ * on rotation and their frames dropped from the index.
+ */
+
+static void history_segment_path(uint32_t segment, char *path, size_t len) {
+    snprintf(path, len, HISTORY_SEGMENT_FMT, segment);
+}
+
+static int history_segment_open(History *h, uint32_t segment, int flags) {
+    char path[64];
+    history_segment_path(segment, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC | flags, 0644);
+    if (fd < 0) {
+        perror("open history segment");
+        return CL_ERR;
+    }
+    h->fds[segment % HISTORY_SEGMENTS] = fd;
+    h->segment = segment;
+    h->size = 0;
+    return CL_OK;
+}
+
+static int history_init(History *h) {
+    for (int i = 0; i < HISTORY_SEGMENTS; i++)
+        h->fds[i] = -1;
+    h->first_id = h->next_id = 0;
+    h->entries = cl_malloc(HISTORY_MAXLEN * sizeof(HistoryEntry));
+    return history_segment_open(h, 0, O_CREAT | O_TRUNC);
+}
+
+static int history_rotate(History *h) {
+    uint32_t next = h->segment + 1;
+    int slot = next % HISTORY_SEGMENTS;
+    if (h->fds[slot] >= 0) {
+        // The oldest segment goes away, together with its frames
+        uint32_t oldest = next - HISTORY_SEGMENTS;
+        char path[64];
+        close(h->fds[slot]);
+        h->fds[slot] = -1;
+        history_segment_path(oldest, path, sizeof(path));
+        unlink(path);
+        while (h->first_id < h->next_id &&
+               h->entries[h->first_id % HISTORY_MAXLEN].segment == oldest)
+            h->first_id++;
+    }
+    return history_segment_open(h, next, O_CREAT | O_TRUNC);
+}
+
+static int history_append(History *h, const char *frame, size_t len) {
+    if (h->size > 0 && h->size + (off_t)len > h->segment_max)
+        if (history_rotate(h) == CL_ERR)
+            return CL_ERR;
+
+    ssize_t n = write(h->fds[h->segment % HISTORY_SEGMENTS], frame, len);
+    if (n != (ssize_t)len) {
+        perror("write history");
+        return CL_ERR;
+    }
+
+    if (h->next_id - h->first_id == HISTORY_MAXLEN)
+        h->first_id++;
+    h->entries[h->next_id % HISTORY_MAXLEN] =
+        (HistoryEntry){.segment = h->segment, .len = len, .offset = h->size};
+    h->size += len;
+    h->next_id++;
+    return CL_OK;
+}
+
+// Length of frame `id`, 0 if it's not stored anymore
+static inline size_t history_len(const History *h, uint64_t id) {
+    if (id < h->first_id || id >= h->next_id)
+        return 0;
+    return h->entries[id % HISTORY_MAXLEN].len;
+}
+
+/*
+ * Read frame `id` into `buf`, which fits `len` bytes; returns its length,
+ * 0 if it's not stored anymore or CL_ERR on error
+ */
+static ssize_t history_read(const History *h, uint64_t id, char *buf,
+                            size_t len) {
+    if (id < h->first_id || id >= h->next_id)
+        return 0;
+    const HistoryEntry *e = &h->entries[id % HISTORY_MAXLEN];
+    if (e->len > len)
+        return CL_ERR;
+    ssize_t n = pread(h->fds[e->segment % HISTORY_SEGMENTS], buf, e->len,
+                      e->offset);
+    if (n != (ssize_t)e->len) {
+        perror("pread history");
+        return CL_ERR;
+    }
+    return n;
+}
+
+/*
+ * Point the cursor to the last `count` frames stored, replay will stop at
+ * the last one stored at the time of the request
+ */
+static void history_seek(const History *h, HistoryCursor *cur, size_t count) {
+    uint64_t stored = h->next_id - h->first_id;
+    cur->end = h->next_id;
+    cur->next = cur->end - (count < stored ? count : stored);
+    cur->sent = 0;
+}
+
+static inline int history_replaying(const HistoryCursor *cur) {
+    return cur->next < cur->end;
+}
+
+/*
+ * Send the next chunk of the replay: frames living in the same segment are
+ * contiguous, so up to `limit` bytes of them are coalesced into a single
+ * sendfile call, always completing the frame partially sent if any.
+ * Returns CL_OK when some progress has been made, CL_AGAIN if the socket
+ * would block and CL_ERR on error or if the frame partially sent has been
+ * evicted meanwhile (i.e. the client is too slow to keep up).
+ */
+static int history_replay(Server *server, int fd, HistoryCursor *cur,
+                          size_t limit) {
+    const History *h = &server->history;
+    if (cur->next < h->first_id) {
+        if (cur->sent > 0)
+            return CL_ERR;
+        cur->next = h->first_id;
+        if (!history_replaying(cur))
+            return CL_OK;
+    }
+
+    const HistoryEntry *e = &h->entries[cur->next % HISTORY_MAXLEN];
+    off_t offset = e->offset + cur->sent;
+    size_t count = e->len - cur->sent;
+    for (uint64_t id = cur->next + 1; id < cur->end && count < limit; ++id) {
+        const HistoryEntry *n = &h->entries[id % HISTORY_MAXLEN];
+        if (n->segment != e->segment)
+            break;
+        count += n->len;
+    }
+
+    ssize_t n = cl_sendfile(server, fd, h->fds[e->segment % HISTORY_SEGMENTS],
+                            &offset, count);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return CL_AGAIN;
+        perror("sendfile");
+        return CL_ERR;
+    }
+    if (n == 0)
+        return CL_ERR;
+
+    // Move the cursor forward by the frames fully sent
+    while (n > 0) {
+        size_t left = h->entries[cur->next % HISTORY_MAXLEN].len - cur->sent;
+        if ((size_t)n < left) {
+            cur->sent += n;
+            n = 0;
+        } else {
+            n -= left;
+            cur->sent = 0;
+            cur->next++;
+        }
+    }
+    return CL_OK;
+}
+
+/*
+ * Replay for clients not using the plain encoding, frames can't go straight
+ * from the page cache to the socket: up to `limit` bytes of them are read,
+ * encoded one by one and queued on the client bulk lane. Returns CL_OK or
+ * CL_ERR on error.
+ */
+static int history_replay_frames(Server *server, Client *c, size_t limit) {
+    const History *h = &server->history;
+    HistoryCursor *cur = &c->replay;
+    if (cur->next < h->first_id)
+        cur->next = h->first_id;
+
+    for (size_t count = 0; history_replaying(cur) && count < limit;) {
+        size_t len = history_len(h, cur->next), framelen;
+        char *msg = arena_alloc(&server->scratch, len);
+        ssize_t n = history_read(h, cur->next, msg, len);
+        if (n <= 0)
+            return CL_ERR;
+        const char *frame =
+            message_encode(server, c->encoding, msg, n, &framelen);
+        if (frame == NULL)
+            return CL_ERR;
+        if (c->encoding == ENCODING_DEFLATE)
+            server->compressor.sent++;
+        buffer_append(&c->out[LANE_BULK], frame, framelen);
+        count += n;
+        cur->next++;
+    }
+    return CL_OK;
+}
+
+/*
+ * =====================================================
+ *                 STATE SNAPSHOTS
+ * =====================================================
+ *
+ * To restart without losing the recent history, every snapshot_interval
+ * seconds the state is encoded into a compact binary image: a fixed
+ * header followed by the history index entries, oldest first.
+ *
+ * Encoding is just a couple of memcpy on the event loop, the slow part,
+ * writing and syncing the file, is left to a background thread. The file
+ * is written aside and renamed, so there's always a complete snapshot on
+ * disk. At startup it's mmap'ed and the index is copied back in place,
+ * the segments it refers to are reopened as they are.
+ */
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t segment;
+    uint64_t size;
+    uint64_t first_id;
+    uint64_t next_id;
+    Stats stats;
+} SnapshotHeader;
+
+static size_t snapshot_encode(const Server *server, char **image) {
+    const History *h = &server->history;
+    uint64_t count = h->next_id - h->first_id;
+    size_t len = sizeof(SnapshotHeader) + count * sizeof(HistoryEntry);
+    char *buf = cl_malloc(len);
+
+    SnapshotHeader header = {.magic = SNAPSHOT_MAGIC,
+                             .version = SNAPSHOT_VERSION,
+                             .segment = h->segment,
+                             .size = h->size,
+                             .first_id = h->first_id,
+                             .next_id = h->next_id,
+                             .stats = server->stats};
+    memcpy(buf, &header, sizeof(header));
+
+    // The ring may wrap around, copy it in two parts at most
+    HistoryEntry *entries = (HistoryEntry *)(buf + sizeof(header));
+    size_t start = h->first_id % HISTORY_MAXLEN;
+    size_t head = count < HISTORY_MAXLEN - start ? count : HISTORY_MAXLEN - start;
+    memcpy(entries, h->entries + start, head * sizeof(HistoryEntry));
+    memcpy(entries + head, h->entries, (count - head) * sizeof(HistoryEntry));
+
+    *image = buf;
+    return len;
+}
+
+static int snapshot_write(const char *image, size_t len) {
+    const char *tmp = SNAPSHOT_PATH ".tmp";
+    int fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0)
+        goto err;
+    for (size_t off = 0; off < len;) {
+        ssize_t n = write(fd, image + off, len - off);
+        if (n < 0) {
+            close(fd);
+            goto err;
+        }
+        off += n;
+    }
+    if (fsync(fd) < 0) {
+        close(fd);
+        goto err;
+    }
+    close(fd);
+    if (rename(tmp, SNAPSHOT_PATH) < 0)
+        goto err;
+    return CL_OK;
+
+err:
+    perror("snapshot");
+    return CL_ERR;
+}
+
+static void *snapshot_thread(void *arg) {
+    Snapshotter *s = arg;
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (s->image == NULL)
+            pthread_cond_wait(&s->cond, &s->lock);
+        char *image = s->image;
+        size_t len = s->len;
+        pthread_mutex_unlock(&s->lock);
+
+        (void)snapshot_write(image, len);
+
+        pthread_mutex_lock(&s->lock);
+        free(s->image);
+        s->image = NULL;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+
+static int snapshot_start(Snapshotter *s) {
+    s->image = NULL;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->thread, NULL, snapshot_thread, s) != 0) {
+        perror("pthread_create");
+        return CL_ERR;
+    }
+    return CL_OK;
+}
+
+/*
+ * Hand the current state to the writer thread, a round is just skipped if
+ * it's still busy with the previous one
+ */
+static void snapshot_request(Server *server) {
+    Snapshotter *s = &server->snapshotter;
+    pthread_mutex_lock(&s->lock);
+    if (s->image == NULL) {
+        s->len = snapshot_encode(server, &s->image);
+        pthread_cond_signal(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Restore the history index and counters from a snapshot image; frames
+ * appended after it was taken stay in the segments but are not indexed
+ * anymore.
+ */
+static int snapshot_decode(Server *server, const char *image, size_t len) {
+    History *h = &server->history;
+    SnapshotHeader header;
+    if (len < sizeof(header))
+        return CL_ERR;
+    memcpy(&header, image, sizeof(header));
+    uint64_t count = header.next_id - header.first_id;
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        header.version != SNAPSHOT_VERSION || count > HISTORY_MAXLEN ||
+        len != sizeof(header) + count * sizeof(HistoryEntry))
+        return CL_ERR;
+
+    for (int i = 0; i < HISTORY_SEGMENTS; i++)
+        h->fds[i] = -1;
+    h->entries = cl_malloc(HISTORY_MAXLEN * sizeof(HistoryEntry));
+    h->first_id = header.first_id;
+    h->next_id = header.next_id;
+    const HistoryEntry *entries =
+        (const HistoryEntry *)(image + sizeof(header));
+    for (uint64_t i = 0; i < count; ++i)
+        h->entries[(h->first_id + i) % HISTORY_MAXLEN] = entries[i];
+
+    // Reopen the segments, dropping the frames of any missing one
+    uint32_t oldest = header.segment >= HISTORY_SEGMENTS - 1
+                          ? header.segment - (HISTORY_SEGMENTS - 1)
+                          : 0;
+    for (uint32_t seg = oldest; seg <= header.segment; ++seg) {
+        if (history_segment_open(h, seg, 0) == CL_OK)
+            continue;
+        if (seg == header.segment &&
+            history_segment_open(h, seg, O_CREAT | O_TRUNC) == CL_ERR)
+            return CL_ERR;
+        while (h->first_id < h->next_id &&
+               h->entries[h->first_id % HISTORY_MAXLEN].segment <= seg)
+            h->first_id++;
+    }
+    struct stat st;
+    if (fstat(h->fds[h->segment % HISTORY_SEGMENTS], &st) == 0)
+        h->size = st.st_size;
+
+    server->stats = header.stats;
+    return CL_OK;
+}
+
+/*
+ * Restore the state from the last snapshot on disk, if any
+ */
+static int snapshot_load(Server *server) {
+    int fd = open(SNAPSHOT_PATH, O_RDONLY);
+    if (fd < 0)
+        return CL_ERR;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return CL_ERR;
+    }
+    char *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return CL_ERR;
+
+    int rc = snapshot_decode(server, image, st.st_size);
+    munmap(image, st.st_size);
+    if (rc == CL_ERR) {
+        fprintf(stderr, "Invalid snapshot %s, ignoring it\n", SNAPSHOT_PATH);
+        return CL_ERR;
+    }
+    CL_LOG("Restored %lu history messages from %s\n",
+           server->history.next_id - server->history.first_id, SNAPSHOT_PATH);
+    return CL_OK;
+}
+
+/*
+ * =====================================================
+ *                 PRESENCE
+ * =====================================================
+ *
+ * Friend lists form a graph of nicks, each one keeping the adjacency sets
+ * of the nicks it follows and of those following it, its watchers. A nick
+ * going online or offline is told to its watchers only, instead of to the
+ * whole chat, so a connection costs as much as the friends it has.
+ *
+ * Changes are not delivered straight away: a nick with watchers whose
+ * presence changes joins a dirty list, flushed by the event loop
+ * presence_interval ms after the first change in it. By then only the
+ * current state matters, a flapping connection or a quick resume costs
+ * at most one update per interval, or none if it ends up where it was.
+ *
+ * Friend lists belong to nicks, not to connections, so they survive
+ * reconnections and a nick change just switches to the list of the new
+ * one.
+ */
+
+// Presence of a nick, created on first use
+static Contact *contact_get(Atom *nick) {
+    if (nick->contact)
+        return nick->contact;
+    Contact *ct = cl_malloc(sizeof(Contact));
+    *ct = (Contact){.nick = nick};
+    nick->refs++;
+    nick->contact = ct;
+    return ct;
+}
+
+// Drop the presence of a nick once nothing refers to it
+static void contact_put(Server *server, Contact *ct) {
+    if (ct->online > 0 || ct->dirty || ct->friends.len > 0 ||
+        ct->watchers.len > 0)
+        return;
+    ct->nick->contact = NULL;
+    atom_release(&server->interns, ct->nick);
+    free(ct->friends.items);
+    free(ct->watchers.items);
+    free(ct);
+}
+
+static void presence_changed(Server *server, Contact *ct) {
+    Presence *p = &server->presence;
+    if (ct->dirty) {
+        p->coalesced++;
+        return;
+    }
+    if (ct->watchers.len == 0) {
+        ct->announced = ct->online > 0;
+        return;
+    }
+    if (p->dirty == NULL)
+        p->deadline = now_ms() + server->config.presence_interval;
+    ct->dirty = 1;
+    ct->next_dirty = p->dirty;
+    p->dirty = ct;
+}
+
+// A client starts using its nick
+static void presence_attach(Server *server, Client *c) {
+    Contact *ct = contact_get(c->nick);
+    c->next_nick = ct->clients;
+    ct->clients = c;
+    if (ct->online++ == 0)
+        presence_changed(server, ct);
+}
+
+// A client stops using its nick
+static void presence_detach(Server *server, Client *c) {
+    Contact *ct = c->nick->contact;
+    Client **p = &ct->clients;
+    while (*p != c)
+        p = &(*p)->next_nick;
+    *p = c->next_nick;
+    if (--ct->online == 0)
+        presence_changed(server, ct);
+    contact_put(server, ct);
+}
+
+// Add the edge watcher -> nick, CL_ERR if the friend list is full
+static int presence_follow(Server *server, Atom *watcher, Atom *nick) {
+    Contact *from = contact_get(watcher);
+    if (from->friends.len >= (uint32_t)server->config.friends_max &&
+        atomset_find(&from->friends, nick) < 0) {
+        contact_put(server, from);
+        return CL_ERR;
+    }
+    Contact *to = contact_get(nick);
+    atomset_add(&from->friends, nick);
+    atomset_add(&to->watchers, watcher);
+    return CL_OK;
+}
+
+static void presence_unfollow(Server *server, Atom *watcher, Atom *nick) {
+    Contact *from = watcher->contact, *to = nick->contact;
+    if (from == NULL || to == NULL)
+        return;
+    atomset_remove(&from->friends, nick);
+    atomset_remove(&to->watchers, watcher);
+    contact_put(server, from);
+    contact_put(server, to);
+}
+
+// Milliseconds the event loop can wait before flushing, -1 if nothing's due
+static int presence_timeout(const Server *server) {
+    if (server->presence.dirty == NULL)
+        return -1;
+    int64_t left = server->presence.deadline - now_ms();
+    return left > 0 ? left : 0;
+}
+
+/*
+ * =====================================================
+ *                 JOIN NOTICES
+ * =====================================================
+ *
+ * Everyone is told who joins and leaves the chat, but not one broadcast
+ * per event: a reconnect storm after a deploy would cost O(N) each, so
+ * O(N^2) overall. Events are collected over a window instead, starting at
+ * the first one, and go out as a single notice
+ *
+ * 3 users joined: alice, bob, carol
+ *
+ * A nick leaving and joining again within the same window cancels out.
+ * The window is notices_window ms, it doubles (up to notices_window_max)
+ * after a window busier than notices_burst events and shrinks back after
+ * quieter ones, so a storm is folded into a handful of notices.
+ */
+
+static void notices_init(Notices *n, uint32_t window) { n->window = window; }
+
+/*
+ * Record a nick joining, or leaving, the chat; `add` and `cancel` are
+ * the joined and left sets, or the other way around
+ */
+static void notices_add(Server *server, AtomSet *add, AtomSet *cancel,
+                        Atom *nick) {
+    Notices *n = &server->notices;
+    if (n->joined.len == 0 && n->left.len == 0)
+        n->deadline = now_ms() + n->window;
+    n->events++;
+    n->total++;
+    if (atomset_find(cancel, nick) >= 0) {
+        atomset_remove(cancel, nick);
+        atom_release(&server->interns, nick);
+    } else if (atomset_find(add, nick) < 0) {
+        nick->refs++;
+        atomset_add(add, nick);
+    }
+}
+
+static void notices_join(Server *server, Atom *nick) {
+    notices_add(server, &server->notices.joined, &server->notices.left, nick);
+}
+
+static void notices_leave(Server *server, Atom *nick) {
+    notices_add(server, &server->notices.left, &server->notices.joined, nick);
+}
+
+static int notices_timeout(const Server *server) {
+    const Notices *n = &server->notices;
+    if (n->joined.len == 0 && n->left.len == 0)
+        return -1;
+    int64_t left = n->deadline - now_ms();
+    return left > 0 ? left : 0;
+}
+
+/*
+ * =====================================================
+ *                 EVENT LOOP
+ * =====================================================
+ *
+ * Each iteration takes at most `batch` events from epoll_wait. The batch
+ * follows the readiness observed: it doubles, up to max_events, when a
+ * wait fills it and halves, down to LOOP_BATCH_MIN, when one returns it
+ * mostly empty.
+ *
+ * Handling an event is bounded too: a client is read for at most
+ * read_budget bytes per iteration. Client sockets are edge triggered, so
+ * one with input left over can't wait for another wake up, it's queued
+ * in the ready list instead and read again on the next iteration, after
+ * all the events of this one, and epoll_wait doesn't block meanwhile.
+ * A chatty client gets its share of every iteration, not all of it.
+ *
+ * Output is deferred the same way: sending to a client only queues the
+ * data in its buffer and puts the client in the dirty list, which is
+ * flushed once per iteration, right before waiting again. A client
+ * getting five messages in an iteration gets a single write and, as
+ * client sockets are TCP_NODELAY, the segments go out straight away,
+ * no later than the end of the iteration. Clients waiting for EPOLLOUT
+ * aren't flushed, the event does it. With the cork option the socket is
+ * corked around the flush, so that the buffer and the history replayed
+ * after it fill whole segments, for two more syscalls per flush.
+ *
+ * The time spent handling each iteration, the wait excluded, is recorded
+ * in a log2 histogram of microseconds, shown by /stats loop; waits that
+ * return nothing are just counted as idle.
+ *
+ * Where wake up latency matters more than CPU, the busy_poll option
+ * makes the loop spin: epoll_wait is always called with a zero timeout,
+ * so the thread never sleeps and is never woken up, and client sockets
+ * get SO_BUSY_POLL with the same value, in microseconds, letting reads
+ * poll the device queue instead of waiting for its interrupt. Raising it
+ * above net.core.busy_read takes CAP_NET_ADMIN. With the cpu option the
+ * loop thread is pinned to a core, to keep its cache and to keep other
+ * work off the core it burns; the snapshot writer isn't pinned.
+ */
+
+// Size the next batch after the events returned by the last wait
+static void loop_adapt(Loop *l, int nfds, int max_events) {
+    if (nfds == l->batch)
+        l->batch *= 2;
+    else if (nfds < l->batch / 4 && l->batch > LOOP_BATCH_MIN)
+        l->batch /= 2;
+    if (l->batch > max_events)
+        l->batch = max_events;
+}
+
+// Pin the calling thread, the event loop, to a core
+static int loop_pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("sched_setaffinity");
+        return CL_ERR;
+    }
+    return CL_OK;
+}
+
+static void loop_record(Loop *l, int64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+    while (us > 1 && bucket < LOOP_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    l->durations[bucket]++;
+    l->iterations++;
+}
+
+// Leave the rest of a client input for the next iteration
+static void loop_requeue(Loop *l, Client *c) {
+    if (c->ready)
+        return;
+    c->ready = 1;
+    c->next_ready = NULL;
+    if (l->ready_tail)
+        l->ready_tail->next_ready = c;
+    else
+        l->ready = c;
+    l->ready_tail = c;
+    l->nready++;
+    l->requeued++;
+}
+
+// Queue a client output for the end of the iteration flush
+static void loop_dirty(Loop *l, Client *c) {
+    l->sends++;
+    if (c->dirty || (c->events & EPOLLOUT))
+        return;
+    c->dirty = 1;
+    c->prev_dirty = NULL;
+    c->next_dirty = l->dirty;
+    if (l->dirty)
+        l->dirty->prev_dirty = c;
+    l->dirty = c;
+}
+
+static void loop_clean(Loop *l, Client *c) {
+    if (!c->dirty)
+        return;
+    if (c->prev_dirty)
+        c->prev_dirty->next_dirty = c->next_dirty;
+    else
+        l->dirty = c->next_dirty;
+    if (c->next_dirty)
+        c->next_dirty->prev_dirty = c->prev_dirty;
+    c->dirty = 0;
+}
+
+static Client *loop_pop(Loop *l) {
+    Client *c = l->ready;
+    if (c == NULL)
+        return NULL;
+    l->ready = c->next_ready;
+    if (l->ready == NULL)
+        l->ready_tail = NULL;
+    l->nready--;
+    c->ready = 0;
+    return c;
+}
+
+// Drop a client going away from the ready list
+static void loop_forget(Loop *l, Client *c) {
+    if (!c->ready)
+        return;
+    Client **p = &l->ready, *prev = NULL;
+    while (*p != c) {
+        prev = *p;
+        p = &(*p)->next_ready;
+    }
+    *p = c->next_ready;
+    if (l->ready_tail == c)
+        l->ready_tail = prev;
+    l->nready--;
+    c->ready = 0;
+}
+
+/*
+ * Append to `str` the iterations duration histogram, see arena_catf: the
+ * upper bound of the bucket holding the median and the 99th percentile,
+ * then the non empty buckets as <bound>:<count>, all in microseconds
+ */
+static char *loop_format(const Loop *l, Arena *a, char *str, size_t *len) {
+    uint64_t seen = 0, p50 = 0, p99 = 0;
+    for (int i = 0; i < LOOP_BUCKETS; i++) {
+        seen += l->durations[i];
+        if (p50 == 0 && seen * 2 >= l->iterations && seen > 0)
+            p50 = 2ULL << i;
+        if (p99 == 0 && seen * 100 >= l->iterations * 99 && seen > 0)
+            p99 = 2ULL << i;
+    }
+    str = arena_catf(a, str, len,
+                     "loop iterations %lu idle %lu batch %d requeued %lu "
+                     "sends %lu flushes %lu shed %lu p50 <%luus p99 <%luus:",
+                     l->iterations, l->idle, l->batch, l->requeued, l->sends,
+                     l->flushes, l->shed, p50, p99);
+    for (int i = 0; i < LOOP_BUCKETS; i++) {
+        if (l->durations[i] == 0)
+            continue;
+        if (i == LOOP_BUCKETS - 1)
+            str = arena_catf(a, str, len, " inf:%lu", l->durations[i]);
+        else
+            str = arena_catf(a, str, len, " %llu:%lu", 2ULL << i,
+                             l->durations[i]);
+    }
+    return str;
+}
+
+/*
+ * =====================================================
+ *                 NETWORKING HELPERS
+ * =====================================================
+ *
+ * This server will adopt a simple text protocol TCP-based; to manage
+ * the communication, we're defining a couple of useful helpers to
+ * create a connection (TCP stream) and to read and write data from a
+ * connected stream.
+ *
+ * - listen;
+ * - accept;
+ * - set_nonblocking; useful to leverage EPOLL (or SELECT/POLL, KQUEUE
+ *   on BSD-like systems) and perform non-blocking reads/writes
+ * - read
+ * - write
+ */
+
+/* Set non-blocking socket */
+static int set_nonblocking(int fd) {
+    int flags, result;
+    flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags == -1)
+        goto err;
+
+    result = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (result == -1)
+        goto err;
+
+    return CL_OK;
+
+err:
+
+    fprintf(stderr, "set_nonblocking: %s\n", strerror(errno));
+    return CL_ERR;
+}
+
+static int cl_listen(const char *host, int port, int backlog) {
+
+    int listen_fd = -1;
+    const struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                                   .ai_socktype = SOCK_STREAM,
+                                   .ai_flags = AI_PASSIVE};
+    struct addrinfo *result, *rp;
+    char port_str[6];
+
+    snprintf(port_str, 6, "%i", port);
+
+    if (getaddrinfo(host, port_str, &hints, &result) != 0)
+        goto err;
+
+    /* Create a listening socket */
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        listen_fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC,
+                           rp->ai_protocol);
+        if (listen_fd < 0)
+            continue;
+
+        /* set SO_REUSEADDR so the socket will be reusable after process kill */
+        if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1},
+                       sizeof(int)) < 0)
+            goto err;
+
+        /* Bind it to the addr:port opened on the network interface */
+        if (bind(listen_fd, rp->ai_addr, rp->ai_addrlen) == 0)
+            break; // Succesful bind
+        close(listen_fd);
+    }
+
+    freeaddrinfo(result);
+    if (rp == NULL)
+        goto err;
+
+    /*
+     * Let's make the socket non-blocking (strongly advised to use the
+     * eventloop)
+     */
+    (void)set_nonblocking(listen_fd);
+
+    /* Finally let's make it listen */
+    if (listen(listen_fd, backlog) != 0)
+        goto err;
+
+    return listen_fd;
+err:
+    return CL_ERR;
+}
+
+/*
+ * Listen on a Unix stream socket, for clients on the same host that can
+ * skip the TCP stack; a stale socket file left by a crash is replaced
+ */
+static int cl_listen_unix(const char *path, int backlog) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return CL_ERR;
+    strcpy(addr.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+        return CL_ERR;
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, backlog) != 0) {
+        close(listen_fd);
+        return CL_ERR;
+    }
+    (void)set_nonblocking(listen_fd);
+    return listen_fd;
+}
+
+/*
+ * Accept a connection, TCP ones keep at most `lowat` unsent bytes queued
+ * and busy poll for `busy_poll` us when reading, if not 0
+ */
+static int cl_accept(int listen_fd, int lowat, int busy_poll) {
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+
+    /* Let's accept on listening socket */
+    fd = accept4(listen_fd, (struct sockaddr *)&addr, &addrlen, SOCK_CLOEXEC);
+    if (fd <= 0)
+        goto exit;
+
+    (void)set_nonblocking(fd);
+    if (addr.ss_family == AF_UNIX)
+        return fd;
+
+    /*
+     * Keep the unsent data queued in the kernel low, the rest waits in
+     * userspace where live messages can still overtake history backlog
+     */
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                   &lowat, sizeof(lowat)) < 0)
+        perror("setsockopt TCP_NOTSENT_LOWAT");
+    // Writes are coalesced per iteration, see EVENT LOOP, no need to wait
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)) < 0)
+        perror("setsockopt TCP_NODELAY");
+    if (busy_poll > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+                                    sizeof(busy_poll)) < 0) {
+        // Most likely not allowed, no point in repeating it every accept
+        static int warned = 0;
+        if (!warned++)
+            perror("setsockopt SO_BUSY_POLL");
+    }
+    return fd;
+exit:
+    if (errno != EWOULDBLOCK && errno != EAGAIN)
+        perror("accept");
+    return CL_ERR;
+}
+
+/*
+ * Out of file descriptors the pending connection stays in the backlog, and
+ * the level triggered listeners would wake the loop up again and again:
+ * they're taken out of epoll for ACCEPT_BACKOFF_MS, connections queue
+ * meanwhile, hopefully after some clients left
+ */
+static void accept_pause(Server *server) {
+    if (server->accept_resume)
+        return;
+    CL_LOG("Out of file descriptors, not accepting for %d ms\n",
+           ACCEPT_BACKOFF_MS);
+    int listeners[] = {server->fd, server->ws_fd, server->unix_fd};
+    for (size_t i = 0; i < sizeof(listeners) / sizeof(listeners[0]); i++)
+        if (listeners[i] >= 0 &&
+            epoll_ctl(server->epollfd, EPOLL_CTL_DEL, listeners[i], NULL) < 0)
+            perror("epoll_ctl: listener fd");
+    server->accept_resume = now_ms() + ACCEPT_BACKOFF_MS;
+}
+
+// Time left until the listeners are polled again, -1 if they are
+static int accept_timeout(const Server *server) {
+    if (server->accept_resume == 0)
+        return -1;
+    int64_t left = server->accept_resume - now_ms();
+    return left > 0 ? left : 0;
+}
+
+static void accept_resume(Server *server) {
+    int listeners[] = {server->fd, server->ws_fd, server->unix_fd};
+    for (size_t i = 0; i < sizeof(listeners) / sizeof(listeners[0]); i++) {
+        ev.events = EPOLLIN;
+        ev.data.fd = listeners[i];
+        if (listeners[i] >= 0 &&
+            epoll_ctl(server->epollfd, EPOLL_CTL_ADD, listeners[i], &ev) < 0)
+            perror("epoll_ctl: listener fd");
+    }
+    server->accept_resume = 0;
+}
+
+// Bytes queued for a client on all its lanes
+static size_t client_pending(const Client *c) {
+    size_t pending = 0;
+    for (int i = 0; i < LANES; i++)
+        pending += buffer_pending(&c->out[i]);
+    return pending;
+}
+
+// Whether a piece of a file is written out to a client, its lanes on hold
+static inline int client_receiving(const Client *c) {
+    return c->transfer && c->transfer->to == c->fd &&
+           (c->transfer->piece > 0 ||
+            c->transfer->headsent < c->transfer->headlen);
+}
+
+/*
+ * Charge a client the memory it holds, its buffers included, and flag the
+ * caps being crossed for memory_enforce, see MEMORY
+ */
+static void client_charge(Server *server, Client *c) {
+    const Config *cfg = &server->config;
+    Memory *m = &server->memory;
+    size_t mem = sizeof(Client) + c->in.cap;
+    for (int i = 0; i < LANES; i++)
+        mem += c->out[i].cap;
+    if (server->ws[c->fd])
+        mem += sizeof(WsConn) + server->ws[c->fd]->in.cap;
+    m->used += mem - c->mem;
+    c->mem = mem;
+    if (mem > (size_t)cfg->client_mem_max || m->used > (size_t)cfg->mem_max)
+        m->over = 1;
+    if (m->used > (size_t)cfg->mem_max / 4 * 3)
+        m->pressure = 1;
+}
+
+// Whether a client isn't to be read, to let memory go down, see MEMORY
+static int client_over(const Server *server, const Client *c) {
+    return c->mem > (size_t)server->config.client_mem_max / 2 ||
+           server->memory.pressure;
+}
+
+/*
+ * Keep EPOLLOUT registered only while the client has something left to
+ * send, to be woken up as soon as the socket is writable again
+ */
+static void client_update_events(Server *server, Client *c) {
+    uint32_t events = EPOLLIN | EPOLLET;
+    if (client_receiving(c) || client_pending(c) > 0 ||
+        history_replaying(&c->replay))
+        events |= EPOLLOUT;
+    if (events == c->events)
+        return;
+    ev.events = events;
+    ev.data.fd = c->fd;
+    if (epoll_ctl(server->epollfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+        perror("epoll_ctl: client fd");
+    c->events = events;
+}
+
+/*
+ * Write out the lanes of a client, until the socket would block. What's
+ * sent to a client is queued on a lane by class, in priority order
+ *
+ * - LANE_CONTROL replies to its commands and server control messages
+ * - LANE_LIVE chat messages
+ * - LANE_NOTICE join and leave notices and presence updates
+ * - LANE_BULK history backlog of encoded replays, see client_flush
+ *
+ * Frames must never interleave on the wire, so a lane is written from a
+ * frame boundary to a frame boundary: whatever it holds when picked, the
+ * most urgent lane with anything queued, `left` bytes, goes out before
+ * any other lane is picked. Anything queued meanwhile on a more urgent
+ * lane then goes ahead of the rest of a less urgent one, so a client
+ * catching up doesn't delay live messages more than a lane content.
+ */
+static int client_write_lanes(Server *server, Client *c) {
+    for (;;) {
+        if (c->left == 0) {
+            c->lane = 0;
+            while (c->lane < LANES && buffer_pending(&c->out[c->lane]) == 0)
+                c->lane++;
+            if (c->lane == LANES)
+                break;
+            c->left = buffer_pending(&c->out[c->lane]);
+        }
+        Buffer *b = &c->out[c->lane];
+        ssize_t n = cl_write(server, c->fd, b->data + b->off, c->left);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CL_OK;
+            perror("write(3)");
+            return CL_ERR;
+        }
+        b->off += n;
+        c->left -= n;
+        if (buffer_pending(b) > 0)
+            continue;
+        // Big buffers left by a burst are given back, any under pressure,
+        // see MEMORY
+        if (b->cap > LANE_KEEP || server->memory.pressure) {
+            free(b->data);
+            *b = (Buffer){0};
+        } else {
+            b->off = b->len = 0;
+        }
+    }
+    c->synced = c->queued;
+    return CL_OK;
+}
+
+/*
+ * Take the encoding a client asked for, once everything queued for it
+ * before is out: the plain ack is the last frame in the old encoding, so
+ * the client knows where the new one starts
+ */
+static void client_switch(Client *c) {
+    static const char ack[] = "Server\r\nCompression on\n";
+    buffer_append(&c->out[LANE_CONTROL], ack, sizeof(ack) - 1);
+    c->encoding = c->switching;
+    c->switching = 0;
+}
+
+/*
+ * Write out everything pending for a client, until the socket would block.
+ * Frames must never interleave on the wire, but at every frame boundary of
+ * the replay live messages queued meanwhile take priority; the next chunk
+ * of history is only produced once they're out. As client sockets only
+ * report writable with less than outq_low_watermark bytes unsent, at most
+ * a chunk of backlog sits in the kernel ahead of live traffic. While a
+ * piece of a file is relayed to the client its output waits, the transfer
+ * being driven from client_read, see FILE TRANSFER.
+ */
+static int client_flush(Server *server, Client *c) {
+    if (client_receiving(c)) {
+        loop_requeue(&server->loop, c);
+        return CL_OK;
+    }
+    for (;;) {
+        if (c->replay.sent == 0) {
+            if (client_write_lanes(server, c) == CL_ERR)
+                return CL_ERR;
+            if (client_pending(c) > 0)
+                break;
+            if (c->switching) {
+                client_switch(c);
+                continue;
+            }
+        }
+        if (!history_replaying(&c->replay))
+            break;
+        // Encoded frames are produced into the output buffer, written out
+        // on the next round; a plain frame in flight is completed first
+        if (c->encoding != ENCODING_PLAIN && c->replay.sent == 0) {
+            if (history_replay_frames(server, c,
+                                      server->config.history_replay_chunk) ==
+                CL_ERR)
+                return CL_ERR;
+            continue;
+        }
+        // Just complete the frame in flight if live messages are waiting
+        size_t limit = client_pending(c) > 0
+                           ? 0
+                           : (size_t)server->config.history_replay_chunk;
+        int rc = history_replay(server, c->fd, &c->replay, limit);
+        if (rc == CL_ERR)
+            return CL_ERR;
+        if (rc == CL_AGAIN)
+            break;
+    }
+    // All out, a file waiting for it can go
+    if (c->transfer && c->transfer->to == c->fd && c->transfer->accepted &&
+        c->transfer->inpipe > 0 && client_pending(c) == 0 &&
+        c->replay.sent == 0)
+        loop_requeue(&server->loop, c);
+    client_charge(server, c);
+    if (c->paused && !client_over(server, c)) {
+        c->paused = 0;
+        server->memory.paused--;
+        loop_requeue(&server->loop, c);
+    }
+    client_update_events(server, c);
+    return CL_OK;
+}
+
+/*
+ * Send data to a client on `lane`: it's queued and written out with
+ * everything else sent to it in the iteration, see EVENT LOOP. Above
+ * outq_shed bytes queued, or under memory pressure, notices are dropped
+ * rather than queued.
+ */
+static int client_send(Server *server, Client *c, int lane, const char *data,
+                       size_t len) {
+    if (lane == LANE_NOTICE &&
+        (client_pending(c) > (size_t)server->config.outq_shed ||
+         server->memory.pressure)) {
+        server->loop.shed++;
+        return CL_OK;
+    }
+    size_t cap = c->out[lane].cap;
+    buffer_append(&c->out[lane], data, len);
+    if (c->out[lane].cap != cap)
+        client_charge(server, c);
+    loop_dirty(&server->loop, c);
+    return CL_OK;
+}
+
+/*
+ * Send a single message to a client, encoded in its wire format
+ */
+static int client_send_message(Server *server, Client *c, int lane,
+                               const char *msg, size_t len) {
+    if (c->encoding == ENCODING_PLAIN)
+        return client_send(server, c, lane, msg, len);
+    size_t framelen;
+    const char *frame =
+        message_encode(server, c->encoding, msg, len, &framelen);
+    if (frame == NULL)
+        return CL_ERR;
+    if (c->encoding == ENCODING_DEFLATE)
+        server->compressor.sent++;
+    return client_send(server, c, lane, frame, framelen);
+}
+
+/*
+ * Nicks longer than nick_maxlen - 1 are cut; returns CL_ERR, the nick left
+ * as it was, if it has control characters, which would break the
+ * <nick>\r\n<message>\n framing
+ */
+static int client_set_nick(Server *server, Client *c, const char *nick,
+                           size_t len) {
+    if (len >= (size_t)server->config.nick_maxlen)
+        len = server->config.nick_maxlen - 1;
+    for (size_t i = 0; i < len; i++)
+        if (iscntrl((unsigned char)nick[i]))
+            return CL_ERR;
+    Atom *old = c->nick;
+    if (old)
+        presence_detach(server, c);
+    c->nick = intern(&server->interns, nick, len);
+    presence_attach(server, c);
+    if (old)
+        atom_release(&server->interns, old);
+    return CL_OK;
+}
+
+/*
+ * Allocate a client for a connected socket and register it into the event
+ * loop
+ */
+static Client *client_new(Server *server, int fd) {
+    Client *c = cl_malloc(sizeof(Client));
+    *c = (Client){.fd = fd,
+                  .events = EPOLLIN | EPOLLET,
+                  .encoding = server->ws[fd] ? ENCODING_WEBSOCKET
+                                             : ENCODING_PLAIN,
+                  .synced = server->history.next_id,
+                  .queued = server->history.next_id};
+
+    ev.events = c->events;
+    ev.data.fd = fd;
+    if (epoll_ctl(server->epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl: client fd");
+        free(c);
+        return NULL;
+    }
+    server->clients[fd] = c;
+    server->cluster.members++;
+    char nick[NICK_MAXLEN];
+    (void)client_set_nick(server, c, nick,
+                          snprintf(nick, sizeof(nick), "anon:%d", fd));
+    client_charge(server, c);
+    return c;
+}
+
+/*
+ * A client sending or receiving a file is gone, the other end carries on
+ * without it, see FILE TRANSFER; the transfer is freed with the last one
+ */
+static void transfer_leave(Server *server, Client *c) {
+    Transfer *tr = c->transfer;
+    int other = tr->from == c->fd ? tr->to : tr->from;
+    if (tr->from == c->fd)
+        tr->from = -1;
+    else
+        tr->to = -1;
+    c->transfer = NULL;
+    if (other < 0) {
+        close(tr->pipe[0]);
+        close(tr->pipe[1]);
+        free(tr);
+        return;
+    }
+    loop_requeue(&server->loop, server->clients[other]);
+}
+
+static void client_free(Server *server, Client *c) {
+    if (epoll_ctl(server->epollfd, EPOLL_CTL_DEL, c->fd, NULL) < 0)
+        perror("disconnecting client");
+#ifdef HAVE_TLS
+    tls_free(server, c->fd);
+#endif
+    ws_free(server, c->fd);
+    close(c->fd);
+    server->clients[c->fd] = NULL;
+    server->cluster.members--;
+    loop_forget(&server->loop, c);
+    loop_clean(&server->loop, c);
+    if (c->transfer)
+        transfer_leave(server, c);
+    server->memory.used -= c->mem;
+    if (c->paused)
+        server->memory.paused--;
+    notices_leave(server, c->nick);
+    presence_detach(server, c);
+    atom_release(&server->interns, c->nick);
+    free(c->in.data);
+    for (int i = 0; i < LANES; i++)
+        free(c->out[i].data);
+    free(c);
+}
+
+/*
+ * Deliver the pending presence changes to the watchers of each nick, all
+ * of its clients, skipping the nicks back to what was last announced
+ */
+static void presence_flush(Server *server) {
+    Presence *p = &server->presence;
+    while (p->dirty) {
+        Contact *ct = p->dirty;
+        p->dirty = ct->next_dirty;
+        ct->dirty = 0;
+        uint8_t online = ct->online > 0;
+        if (online != ct->announced) {
+            size_t msglen;
+            char *msg = arena_catf(&server->scratch, NULL, &msglen,
+                                   "Server\r\n%s is %s\n", ct->nick->str,
+                                   online ? "online" : "offline");
+            // Encoded once per encoding, shared by the watchers using it
+            const char *frames[ENCODINGS] = {0};
+            size_t framelen[ENCODINGS] = {0};
+            frames[ENCODING_PLAIN] = msg;
+            framelen[ENCODING_PLAIN] = msglen;
+            ct->announced = online;
+            p->updates++;
+            for (uint32_t i = 0; i < ct->watchers.len; i++) {
+                Contact *w = ct->watchers.items[i]->contact;
+                for (Client *c = w->clients; c; c = c->next_nick) {
+                    uint8_t e = c->encoding;
+                    if (frames[e] == NULL)
+                        frames[e] = message_encode(server, e, msg, msglen,
+                                                   &framelen[e]);
+                    if (frames[e] == NULL) {
+                        perror("write(3)");
+                        continue;
+                    }
+                    if (e == ENCODING_DEFLATE)
+                        server->compressor.sent++;
+                    (void)client_send(server, c, LANE_NOTICE, frames[e],
+                                      framelen[e]);
+                }
+            }
+        }
+        contact_put(server, ct);
+    }
+}
+
+/*
+ * =====================================================
+ *                 SESSION RESUME
+ * =====================================================
+ *
+ * Every client gets a random resume token when admitted. When its
+ * connection drops (as opposed to a /quit), the session, i.e. the nick and
+ * the id of the first message it didn't receive, is kept aside for
+ * resume_grace seconds. Reconnecting with
+ *
+ * /resume <token>
+ *
+ * instead of /auth restores it and replays just the messages missed
+ * meanwhile, through the history cursor. Detached sessions live in a
+ * fixed pool, ordered by an LRU list: when the pool is full the oldest one
+ * is evicted.
+ */
+
+static void sessions_init(Sessions *s) {
+    s->head = s->tail = -1;
+    s->free = 0;
+    for (int i = 0; i < RESUME_MAXSESSIONS; i++) {
+        s->slots[i].expires = 0;
+        s->slots[i].next = i + 1 < RESUME_MAXSESSIONS ? i + 1 : -1;
+    }
+}
+
+static void sessions_unlink(Sessions *s, int i) {
+    Session *e = &s->slots[i];
+    if (e->prev >= 0)
+        s->slots[e->prev].next = e->next;
+    else
+        s->head = e->next;
+    if (e->next >= 0)
+        s->slots[e->next].prev = e->prev;
+    else
+        s->tail = e->prev;
+    e->expires = 0;
+    e->next = s->free;
+    s->free = i;
+}
+
+static void sessions_push(Sessions *s, const Session *session) {
+    if (s->free < 0)
+        sessions_unlink(s, s->tail);
+    int i = s->free;
+    Session *e = &s->slots[i];
+    s->free = e->next;
+    *e = *session;
+    e->prev = -1;
+    e->next = s->head;
+    if (s->head >= 0)
+        s->slots[s->head].prev = i;
+    s->head = i;
+    if (s->tail < 0)
+        s->tail = i;
+}
+
+/*
+ * Look a detached session up by token, removing it from the pool; every
+ * entry is compared in constant time
+ */
+static int sessions_take(Sessions *s, const char *token, Session *out) {
+    int found = -1;
+    if (strlen(token) != RESUME_TOKEN_LEN)
+        return CL_ERR;
+    for (int i = s->head; i >= 0; i = s->slots[i].next)
+        if (token_equal(s->slots[i].token, token, RESUME_TOKEN_LEN))
+            found = i;
+    if (found < 0)
+        return CL_ERR;
+    *out = s->slots[found];
+    sessions_unlink(s, found);
+    return CL_OK;
+}
+
+/*
+ * Release the sessions past their deadline; all of them are checked, the
+ * LRU order is the detach one, not the deadline one once a reload changed
+ * resume_grace
+ */
+static void sessions_expire(Sessions *s) {
+    uint32_t now = now_ms() / 1000;
+    for (int i = s->head, next; i >= 0; i = next) {
+        next = s->slots[i].next;
+        if (s->slots[i].expires <= now)
+            sessions_unlink(s, i);
+    }
+}
+
+// The session a client leaves behind, to be resumed within resume_grace
+static Session client_session(const Server *server, const Client *c) {
+    Session session = {.synced = c->synced,
+                       .expires =
+                           now_ms() / 1000 + server->config.resume_grace};
+    memcpy(session.token, c->session, sizeof(session.token));
+    memcpy(session.nick, c->nick->str, c->nick->len + 1);
+    return session;
+}
+
+static void client_detach(Server *server, Client *c) {
+    Session session = client_session(server, c);
+    sessions_push(&server->sessions, &session);
+    CL_LOG("Client disconnected fd=%i\n", c->fd);
+    client_free(server, c);
+}
+
+// Write out what the clients got during the iteration
+static void client_flush_dirty(Server *server) {
+    Loop *l = &server->loop;
+    int cork = server->config.cork;
+    while (l->dirty) {
+        Client *c = l->dirty;
+        loop_clean(l, c);
+        l->flushes++;
+        // Not TCP for Unix sockets, where it just fails
+        if (cork)
+            (void)setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &(int){1},
+                             sizeof(int));
+        if (client_flush(server, c) == CL_ERR) {
+            client_detach(server, c);
+            continue;
+        }
+        if (cork)
+            (void)setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &(int){0},
+                             sizeof(int));
+    }
+}
+
+/*
+ * =====================================================
+ *                 MEMORY
+ * =====================================================
+ *
+ * Everything held on behalf of a client, its state, input and WebSocket
+ * buffers and output lanes, history cursor included, is charged to it
+ * and to a global total by client_charge, whenever a buffer changes size.
+ * Lane buffers grown past LANE_KEEP by a burst are freed once written
+ * out, so the charge goes back down with the backlog. Caps are enforced
+ * in steps, so the server degrades predictably rather than running out of
+ * memory:
+ *
+ * - a client over half of client_mem_max, or any client with the total
+ *   over three quarters of mem_max, is no longer read: nothing it sends
+ *   can add to the backlog until its output is written out. Its empty
+ *   buffers are given back first, as are everyone's under pressure, so
+ *   only bytes still to send or process keep it paused
+ * - past the same three quarters, notices are shed for everyone
+ * - a client over client_mem_max is disconnected, as are the biggest
+ *   consumers while the total is over mem_max, or over the three quarters
+ *   for a whole housekeeping interval; their sessions are kept, so they
+ *   can resume and catch up from the history on disk
+ *
+ * /stats memory shows the total and the top consumers.
+ */
+
+// Give back the buffers of a client with nothing left in them
+static void client_shrink(Server *server, Client *c) {
+    WsConn *ws = server->ws[c->fd];
+    Buffer *bufs[LANES + 2] = {&c->in, ws ? &ws->in : NULL};
+    for (int i = 0; i < LANES; i++)
+        bufs[i + 2] = &c->out[i];
+    for (int i = 0; i < LANES + 2; i++) {
+        if (bufs[i] && bufs[i]->cap > 0 && buffer_pending(bufs[i]) == 0) {
+            free(bufs[i]->data);
+            *bufs[i] = (Buffer){0};
+        }
+    }
+    client_charge(server, c);
+}
+
+// Disconnect a client to give its memory back
+static void memory_evict(Server *server, Client *c) {
+    CL_LOG("Evicting %s, %lu bytes held\n", c->nick->str, c->mem);
+    server->memory.evicted++;
+    client_detach(server, c);
+}
+
+// The client holding the most memory, NULL if there's none
+static Client *memory_top(Server *server) {
+    Client *top = NULL;
+    for (int i = 0; i < server->config.max_clients; i++) {
+        Client *c = server->clients[i];
+        if (c && (top == NULL || c->mem > top->mem))
+            top = c;
+    }
+    return top;
+}
+
+/*
+ * Once per iteration, after the output is written: resume the clients
+ * paused for the total once it's back down, evict the ones over the caps
+ */
+static void memory_enforce(Server *server) {
+    const Config *cfg = &server->config;
+    Memory *m = &server->memory;
+    if (m->pressure && m->used <= (size_t)cfg->mem_max / 4 * 3) {
+        m->pressure = 0;
+        for (int i = 0; i < cfg->max_clients && m->paused > 0; i++) {
+            Client *c = server->clients[i];
+            if (c && c->paused && !client_over(server, c)) {
+                c->paused = 0;
+                m->paused--;
+                loop_requeue(&server->loop, c);
+            }
+        }
+    }
+    if (!m->over)
+        return;
+    m->over = 0;
+    for (int i = 0; i < cfg->max_clients; i++) {
+        Client *c = server->clients[i];
+        if (c && c->mem > (size_t)cfg->client_mem_max)
+            memory_evict(server, c);
+    }
+    while (m->used > (size_t)cfg->mem_max) {
+        Client *top = memory_top(server);
+        if (top == NULL)
+            break;
+        memory_evict(server, top);
+    }
+}
+
+/*
+ * From the housekeeping timer, so pressure can't hold every client paused
+ * for good: the empty buffers are given back, and if that's not enough
+ * twice in a row the biggest consumers are evicted until it's relieved;
+ * memory_enforce then resumes the paused clients.
+ */
+static void memory_relieve(Server *server) {
+    Memory *m = &server->memory;
+    size_t high = (size_t)server->config.mem_max / 4 * 3;
+    if (!m->pressure) {
+        m->stuck = 0;
+        return;
+    }
+    for (int i = 0; i < server->config.max_clients; i++)
+        if (server->clients[i])
+            client_shrink(server, server->clients[i]);
+    if (m->used <= high) {
+        m->stuck = 0;
+        return;
+    }
+    if (!m->stuck) {
+        m->stuck = 1;
+        return;
+    }
+    while (m->used > high) {
+        Client *top = memory_top(server);
+        if (top == NULL)
+            break;
+        memory_evict(server, top);
+    }
+    m->stuck = 0;
+}
+
+/*
+ * Append to `str` the memory counters, the top consumers and the scratch
+ * arena size, see arena_catf
+ */
+static char *memory_format(Server *server, char *str, size_t *len) {
+    const Memory *m = &server->memory;
+    const Client *top[MEMORY_TOP] = {0};
+    for (int i = 0; i < server->config.max_clients; i++) {
+        const Client *c = server->clients[i];
+        if (c == NULL)
+            continue;
+        // Insertion into the top, biggest first
+        for (int j = 0; j < MEMORY_TOP; j++) {
+            if (top[j] == NULL || c->mem > top[j]->mem) {
+                memmove(top + j + 1, top + j,
+                        (MEMORY_TOP - j - 1) * sizeof(*top));
+                top[j] = c;
+                break;
+            }
+        }
+    }
+    Arena *a = &server->scratch;
+    str = arena_catf(a, str, len,
+                     "memory used %lu of %d paused %u evicted %lu top:",
+                     m->used, server->config.mem_max, m->paused, m->evicted);
+    for (int j = 0; j < MEMORY_TOP && top[j]; j++)
+        str = arena_catf(a, str, len, " %s %lu", top[j]->nick->str,
+                         top[j]->mem);
+    return arena_catf(a, str, len, " arena %lu spills %lu", a->head->cap,
+                      a->spills);
+}
+
+/*
+ * =====================================================
+ *                 HOT UPGRADE
+ * =====================================================
+ *
+ * On SIGUSR2 the running process execs a fresh copy of the binary and
+ * hands over everything it needs to carry on without dropping any
+ * connection, through a Unix socket pair:
+ *
+ * - a header with the auth token, carrying the listening socket as
+ *   SCM_RIGHTS, then the WebSocket, Unix socket and cluster ones
+ * - a snapshot image of the state, see STATE SNAPSHOTS
+ * - one record per client, carrying its socket as SCM_RIGHTS, followed by
+ *   the output still pending for it
+ * - the detached sessions, least recent first
+ * - the edges of the friends graph, see PRESENCE
+ *
+ * The old process exits only once the new one acknowledges it's up and
+ * serving, if anything goes wrong on the way it just carries on. Clients
+ * that haven't authenticated yet are not handed over, they'll retry, and
+ * neither are links between nodes, peers dial the new process.
+ */
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t clients;
+    uint32_t sessions;
+    uint32_t friends;
+    uint8_t clustered;
+    uint8_t unix_socket;
+    uint64_t room_seq;
+    uint64_t image_len;
+    char token[TOKEN_MAXLEN + 1];
+} UpgradeHeader;
+
+typedef struct {
+    char nick[NICK_MAXLEN];
+    char session[RESUME_TOKEN_LEN + 1];
+    uint64_t synced;
+    uint64_t queued;
+    HistoryCursor replay;
+    uint64_t pending;
+    uint32_t unread;
+    uint8_t encoding;
+} UpgradeClient;
+
+typedef struct {
+    char watcher[NICK_MAXLEN];
+    char nick[NICK_MAXLEN];
+} UpgradeFriend;
+
+// Path of the binary, re-exec'd on upgrade to pick up a new deploy, and
+// the arguments it was started with, passed on to the new process
+static char exe_path[PATH_MAX];
+static int exe_argc;
+static char **exe_argv;
+
+/*
+ * Resolve the binary path from argv[0] the way the shell found it, through
+ * PATH when it has no slash; the path is left empty if it can't be found,
+ * /proc/self/exe would point to the binary replaced by a deploy
+ */
+static void exe_resolve(const char *argv0) {
+    exe_path[0] = '\0';
+    if (strchr(argv0, '/')) {
+        if (realpath(argv0, exe_path) == NULL)
+            exe_path[0] = '\0';
+        return;
+    }
+    const char *path = getenv("PATH");
+    while (path && *path) {
+        size_t len = strcspn(path, ":");
+        char candidate[PATH_MAX];
+        // An empty entry is the current directory
+        int n = snprintf(candidate, sizeof(candidate), "%.*s/%s",
+                         len ? (int)len : 1, len ? path : ".", argv0);
+        if (n < (int)sizeof(candidate) && access(candidate, X_OK) == 0 &&
+            realpath(candidate, exe_path))
+            return;
+        path += len + (path[len] == ':');
+    }
+    exe_path[0] = '\0';
+}
+
+static int upgrade_send(int sock, const void *data, size_t len, int fd) {
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = len};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (fd >= 0) {
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    while (iov.iov_len > 0) {
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0)
+            return CL_ERR;
+        iov.iov_base = (char *)iov.iov_base + n;
+        iov.iov_len -= n;
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+    }
+    return CL_OK;
+}
+
+static int upgrade_recv(int sock, void *data, size_t len, int *fd) {
+    struct iovec iov = {.iov_base = data, .iov_len = len};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    if (fd) {
+        *fd = -1;
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+    }
+    while (iov.iov_len > 0) {
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0)
+            return CL_ERR;
+        struct cmsghdr *cmsg = msg.msg_controllen ? CMSG_FIRSTHDR(&msg) : NULL;
+        if (fd && cmsg && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        iov.iov_base = (char *)iov.iov_base + n;
+        iov.iov_len -= n;
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+    }
+    return CL_OK;
+}
+
+/*
+ * TLS state living in userspace can't be handed over, those clients are
+ * left behind and their sessions handed over instead, so they can resume
+ * them on the new process; connections fully offloaded to kTLS are plain
+ * sockets to the new process.
+ */
+static int upgrade_transferable(const Server *server, int fd) {
+#ifdef HAVE_TLS
+    return server->tls[fd] == NULL ||
+           server->ktls[fd] == (KTLS_TX | KTLS_RX);
+#else
+    (void)server;
+    (void)fd;
+    return 1;
+#endif
+}
+
+static int upgrade_handover(Server *server, int sock) {
+    uint32_t nclients = 0, nsessions = 0, nfriends = 0;
+    // Changes still pending go out with the clients output
+    presence_flush(server);
+    for (int i = 0; i < server->config.max_clients; i++) {
+        if (server->clients[i] == NULL)
+            continue;
+        if (upgrade_transferable(server, i))
+            nclients++;
+        else
+            nsessions++;
+    }
+    for (int i = server->sessions.head; i >= 0;
+         i = server->sessions.slots[i].next)
+        nsessions++;
+    for (int i = 0; i < INTERN_BUCKETS; i++)
+        for (Atom *a = server->interns.buckets[i]; a; a = a->next)
+            if (a->contact)
+                nfriends += a->contact->friends.len;
+
+    char *image = NULL;
+    size_t image_len = snapshot_encode(server, &image);
+    UpgradeHeader header = {.magic = UPGRADE_MAGIC,
+                            .version = UPGRADE_VERSION,
+                            .clients = nclients,
+                            .sessions = nsessions,
+                            .friends = nfriends,
+                            .clustered = server->cluster.fd >= 0,
+                            .unix_socket = server->unix_fd >= 0,
+                            .room_seq = server->cluster.room.seq,
+                            .image_len = image_len};
+    memcpy(header.token, server->token, sizeof(header.token));
+    int rc = upgrade_send(sock, &header, sizeof(header), server->fd);
+    if (rc == CL_OK)
+        rc = upgrade_send(sock, image, image_len, server->ws_fd);
+    free(image);
+    if (rc == CL_OK && header.unix_socket)
+        rc = upgrade_send(sock, "U", 1, server->unix_fd);
+    if (rc == CL_OK && header.clustered)
+        rc = upgrade_send(sock, "C", 1, server->cluster.fd);
+
+    for (int i = 0; i < server->config.max_clients && rc == CL_OK; i++) {
+        Client *c = server->clients[i];
+        if (c == NULL || !upgrade_transferable(server, i))
+            continue;
+        WsConn *ws = server->ws[i];
+        UpgradeClient record = {.synced = c->synced,
+                                .queued = c->queued,
+                                .replay = c->replay,
+                                .pending = client_pending(c),
+                                .unread = buffer_pending(ws ? &ws->in : &c->in),
+                                .encoding = c->encoding};
+        memcpy(record.nick, c->nick->str, c->nick->len + 1);
+        memcpy(record.session, c->session, sizeof(record.session));
+        rc = upgrade_send(sock, &record, sizeof(record), c->fd);
+        // The lane in flight first, to complete its frame, then by priority
+        int first = c->left > 0 ? c->lane : -1;
+        for (int j = -1; j < LANES && rc == CL_OK; j++) {
+            int lane = j < 0 ? first : j;
+            if (lane < 0 || (j >= 0 && lane == first) ||
+                buffer_pending(&c->out[lane]) == 0)
+                continue;
+            const Buffer *b = &c->out[lane];
+            rc = upgrade_send(sock, b->data + b->off, buffer_pending(b), -1);
+        }
+        const Buffer *in = ws ? &ws->in : &c->in;
+        if (rc == CL_OK && record.unread > 0)
+            rc = upgrade_send(sock, in->data + in->off, record.unread, -1);
+    }
+    for (int i = server->sessions.tail; i >= 0 && rc == CL_OK;
+         i = server->sessions.slots[i].prev)
+        rc = upgrade_send(sock, &server->sessions.slots[i], sizeof(Session),
+                          -1);
+    // The clients left behind, their sessions are the most recent ones
+    for (int i = 0; i < server->config.max_clients && rc == CL_OK; i++) {
+        Client *c = server->clients[i];
+        if (c == NULL || upgrade_transferable(server, i))
+            continue;
+        Session session = client_session(server, c);
+        rc = upgrade_send(sock, &session, sizeof(Session), -1);
+    }
+    for (int i = 0; i < INTERN_BUCKETS && rc == CL_OK; i++) {
+        for (Atom *a = server->interns.buckets[i]; a && rc == CL_OK;
+             a = a->next) {
+            const Contact *ct = a->contact;
+            for (uint32_t j = 0; ct && j < ct->friends.len && rc == CL_OK;
+                 j++) {
+                UpgradeFriend edge = {0};
+                memcpy(edge.watcher, a->str, a->len + 1);
+                memcpy(edge.nick, ct->friends.items[j]->str,
+                       ct->friends.items[j]->len + 1);
+                rc = upgrade_send(sock, &edge, sizeof(edge), -1);
+            }
+        }
+    }
+    if (rc == CL_ERR)
+        return CL_ERR;
+
+    // Wait for the new process to be up and serving
+    char ack;
+    return upgrade_recv(sock, &ack, 1, NULL);
+}
+
+static void upgrade_start(Server *server) {
+    if (exe_path[0] == '\0') {
+        CL_LOG("%s\n", "Upgrade refused, the binary path is unknown");
+        return;
+    }
+    // Pipes half way through a file can't be handed over
+    for (int i = 0; i < server->config.max_clients; i++) {
+        if (server->clients[i] && server->clients[i]->transfer) {
+            CL_LOG("%s\n", "Upgrade refused, file transfers in progress");
+            return;
+        }
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("upgrade: socketpair");
+        return;
+    }
+
+    CL_LOG("Upgrading, exec %s\n", exe_path);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("upgrade: fork");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        // Only the handover socket survives the exec, as fd 3
+        if (dup2(sv[1], 3) < 0)
+            _exit(EXIT_FAILURE);
+        close_range(4, ~0U, 0);
+        char **args = cl_malloc((exe_argc + 3) * sizeof(char *));
+        int n = 0;
+        args[n++] = exe_path;
+        args[n++] = "--upgrade";
+        args[n++] = "3";
+        for (int i = 1; i < exe_argc; i++) {
+            if (strcmp(exe_argv[i], "--upgrade") == 0)
+                i++;
+            else
+                args[n++] = exe_argv[i];
+        }
+        args[n] = NULL;
+        execv(exe_path, args);
+        perror("upgrade: exec");
+        _exit(EXIT_FAILURE);
+    }
+
+    close(sv[1]);
+    if (upgrade_handover(server, sv[0]) == CL_ERR) {
+        CL_LOG("Upgrade of pid %d failed, carrying on\n", pid);
+        close(sv[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    CL_LOG("Handed over to pid %d, bye\n", pid);
+    exit(EXIT_SUCCESS);
+}
+
+/*
+ * New process side of the upgrade: adopt the listening sockets, the state
+ * and the clients of the old one
+ */
+static int upgrade_receive(Server *server, int sock) {
+    UpgradeHeader header;
+    if (upgrade_recv(sock, &header, sizeof(header), &server->fd) == CL_ERR ||
+        memcmp(header.magic, UPGRADE_MAGIC, sizeof(UPGRADE_MAGIC)) != 0 ||
+        header.version != UPGRADE_VERSION || server->fd < 0)
+        goto err;
+    memcpy(server->token, header.token, sizeof(server->token));
+    server->token[TOKEN_MAXLEN] = '\0';
+    server->cluster.room.seq = header.room_seq;
+
+    char *image = cl_malloc(header.image_len);
+    int rc = upgrade_recv(sock, image, header.image_len, &server->ws_fd);
+    if (rc == CL_OK && server->ws_fd < 0)
+        rc = CL_ERR;
+    if (rc == CL_OK)
+        rc = snapshot_decode(server, image, header.image_len);
+    free(image);
+    char c;
+    if (rc == CL_OK && header.unix_socket)
+        rc = upgrade_recv(sock, &c, 1, &server->unix_fd);
+    if (rc == CL_OK && header.clustered)
+        rc = upgrade_recv(sock, &c, 1, &server->cluster.fd);
+    if (rc == CL_ERR)
+        goto err;
+
+    for (uint32_t i = 0; i < header.clients; i++) {
+        UpgradeClient record;
+        int fd;
+        if (upgrade_recv(sock, &record, sizeof(record), &fd) == CL_ERR ||
+            fd < 0 || fd >= server->config.max_clients)
+            goto err;
+        if (record.encoding == ENCODING_WEBSOCKET) {
+            ws_accept(server, fd);
+            server->ws[fd]->open = 1;
+        }
+        Client *c = client_new(server, fd);
+        if (c == NULL)
+            goto err;
+        record.nick[NICK_MAXLEN - 1] = '\0';
+        // An invalid one keeps the anon nick
+        (void)client_set_nick(server, c, record.nick, strlen(record.nick));
+        memcpy(c->session, record.session, sizeof(c->session));
+        c->session[RESUME_TOKEN_LEN] = '\0';
+        c->synced = record.synced;
+        c->queued = record.queued;
+        c->replay = record.replay;
+        c->encoding = record.encoding;
+        if (record.pending > 0) {
+            char *pending = cl_malloc(record.pending);
+            rc = upgrade_recv(sock, pending, record.pending, NULL);
+            if (rc == CL_OK)
+                buffer_append(&c->out[LANE_LIVE], pending, record.pending);
+            free(pending);
+            if (rc == CL_ERR)
+                goto err;
+        }
+        if (record.unread > 0) {
+            char *unread = cl_malloc(record.unread);
+            rc = upgrade_recv(sock, unread, record.unread, NULL);
+            if (rc == CL_OK)
+                buffer_append(server->ws[fd] ? &server->ws[fd]->in : &c->in,
+                              unread, record.unread);
+            free(unread);
+            if (rc == CL_ERR)
+                goto err;
+        }
+        client_charge(server, c);
+        client_update_events(server, c);
+    }
+
+    for (uint32_t i = 0; i < header.sessions; i++) {
+        Session session;
+        if (upgrade_recv(sock, &session, sizeof(session), NULL) == CL_ERR)
+            goto err;
+        session.token[RESUME_TOKEN_LEN] = '\0';
+        session.nick[NICK_MAXLEN - 1] = '\0';
+        sessions_push(&server->sessions, &session);
+    }
+
+    // Clients are already in, so no presence change is raised
+    for (uint32_t i = 0; i < header.friends; i++) {
+        UpgradeFriend edge;
+        if (upgrade_recv(sock, &edge, sizeof(edge), NULL) == CL_ERR)
+            goto err;
+        edge.watcher[NICK_MAXLEN - 1] = '\0';
+        edge.nick[NICK_MAXLEN - 1] = '\0';
+        Atom *watcher = intern(&server->interns, edge.watcher,
+                               strlen(edge.watcher));
+        Atom *nick = intern(&server->interns, edge.nick, strlen(edge.nick));
+        (void)presence_follow(server, watcher, nick);
+        atom_release(&server->interns, watcher);
+        atom_release(&server->interns, nick);
+    }
+
+    CL_LOG("Took over %u clients\n", header.clients);
+    return CL_OK;
+
+err:
+    fprintf(stderr, "upgrade: invalid handover\n");
+    return CL_ERR;
+}
+
+/*
+ * Write a final snapshot from the calling thread, once the writer thread
+ * is done with the one it may be working on
+ */
+static int snapshot_sync(Server *server) {
+    Snapshotter *s = &server->snapshotter;
+    pthread_mutex_lock(&s->lock);
+    while (s->image != NULL)
+        pthread_cond_wait(&s->cond, &s->lock);
+    char *image = NULL;
+    size_t len = snapshot_encode(server, &image);
+    int rc = snapshot_write(image, len);
+    pthread_mutex_unlock(&s->lock);
+    free(image);
+    return rc;
+}
+
+/*
+ * Hand a formatted message to every local client but `fd`, on `lane`.
+ * Chat messages, the live lane, are stored in the history first; messages
+ * are encoded once per wire format, on the first client using it.
+ */
+static void deliver_message(Server *server, const char *msg, size_t msglen,
+                            int fd, int lane) {
+    const char *frames[ENCODINGS] = {0};
+    size_t framelen[ENCODINGS] = {0};
+    int chat = lane == LANE_LIVE;
+
+    if (chat) {
+        (void)history_append(&server->history, msg, msglen);
+        server->stats.messages++;
+    }
+
+    for (int i = 0; i < server->config.max_clients; i++) {
+        Client *c = server->clients[i];
+        if (c == NULL)
+            continue;
+        // The id following the message is where a resume would start from
+        if (chat) {
+            c->queued = server->history.next_id;
+            if (client_pending(c) == 0)
+                c->synced = c->queued;
+        }
+        if (i == fd)
+            continue;
+        CL_LOG("Broadcasting to %s\n", c->nick->str);
+        int rc = CL_ERR;
+        if (c->encoding == ENCODING_PLAIN) {
+            rc = client_send(server, c, lane, msg, msglen);
+        } else {
+            uint8_t e = c->encoding;
+            if (frames[e] == NULL)
+                frames[e] =
+                    message_encode(server, e, msg, msglen, &framelen[e]);
+            if (frames[e]) {
+                if (e == ENCODING_DEFLATE)
+                    server->compressor.sent++;
+                rc = client_send(server, c, lane, frames[e], framelen[e]);
+            }
+        }
+        if (rc == CL_ERR)
+            perror("write(3)");
+    }
+}
+
+/*
+ * =====================================================
+ *                 ROOM OWNERSHIP
+ * =====================================================
+ *
+ * In a cluster every room has an owner node, the only one ordering its
+ * messages, so nodes never have to agree on an order message by message:
+ * the others submit their clients messages to the owner, which numbers
+ * them and sends them back out, see CLUSTER.
+ *
+ * Owners come from a consistent hash ring: this node and each peer whose
+ * link is up are hashed RING_VNODES times onto a 32 bit circle, a room
+ * belongs to the node of the first point at or after its own hash. A
+ * node joining or leaving only moves the rooms in its arcs, and the
+ * virtual nodes spread them evenly over the others. Nodes agree on the
+ * owner as soon as they see the same peers up.
+ *
+ * When a room moves away from a node, the node hands the new owner its
+ * last HANDOFF_MAX messages with their sequence numbers, so numbering and
+ * the recent history carry on. The chat is a single room for now,
+ * CHAT_ROOM.
+ */
+
+static uint32_t ring_hash(const char *str, size_t len) {
+    // FNV-1a keeps close strings close, mix it up
+    uint32_t h = intern_hash(str, len);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int ring_cmp(const void *a, const void *b) {
+    const RingPoint *x = a, *y = b;
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+// Place this node and the peers up on the ring
+static void ring_build(Cluster *cl) {
+    Ring *r = &cl->ring;
+    r->len = 0;
+    for (int n = -1; n < cl->npeers; n++) {
+        if (n >= 0 && !cl->peers[n].up)
+            continue;
+        const char *addr = n < 0 ? cl->node : cl->peers[n].addr;
+        for (int v = 0; v < RING_VNODES; v++) {
+            char key[NODE_MAXLEN + 8];
+            int len = snprintf(key, sizeof(key), "%s#%d", addr, v);
+            r->points[r->len++] =
+                (RingPoint){.hash = ring_hash(key, len), .node = n};
+        }
+    }
+    qsort(r->points, r->len, sizeof(RingPoint), ring_cmp);
+}
+
+// The owner of a room, a peer index or -1 for this node
+static int ring_owner(const Ring *r, const char *room, size_t len) {
+    if (r->len == 0)
+        return -1;
+    uint32_t hash = ring_hash(room, len);
+    int lo = 0, hi = r->len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (r->points[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return r->points[lo % r->len].node;
+}
+
+// Message `seq` of the room is stored as history frame `id`
+static void room_remember(Room *room, uint64_t seq, uint64_t id) {
+    room->recent[room->count++ % HANDOFF_MAX] =
+        (RoomEntry){.seq = seq, .id = id};
+    if (seq > room->seq)
+        room->seq = seq;
+}
+
+/*
+ * A message numbered `seq` comes from the owner, which numbers them one
+ * by one: anything but the next number means messages were lost, e.g.
+ * queued on a link that dropped, or numbered by two nodes at once. The
+ * message is delivered anyway, it's only counted and logged.
+ */
+static void room_check(Cluster *cl, uint64_t seq) {
+    Room *room = &cl->room;
+    // A node just joined takes the numbering where it finds it
+    if (room->count == 0 && room->seq == 0)
+        return;
+    if (seq <= room->seq) {
+        room->dups++;
+        CL_LOG("Room message %lu already seen, at %lu\n", seq, room->seq);
+    } else if (seq > room->seq + 1) {
+        room->gaps += seq - room->seq - 1;
+        CL_LOG("Room messages %lu to %lu missed\n", room->seq + 1, seq - 1);
+    }
+}
+
+/*
+ * =====================================================
+ *                 CLUSTER
+ * =====================================================
+ *
+ * Several nodes can share the chat, each one serving its own clients.
+ * A node is started with the options, see CONFIGURATION,
+ *
+ * cluster <host:port> the address it takes links on, and its id
+ * peers <host:port>,... the addresses of the other nodes
+ *
+ * also set through CHATLITE_CLUSTER and CHATLITE_PEERS, and the same
+ * token as its peers. Every node dials every peer,
+ * so a pair of nodes is joined by two persistent links, each carrying
+ * traffic one way. A link is a stream of frames
+ *
+ * <type:1> <length:2, big endian> <payload>
+ *
+ * - LINK_HELLO "<node> <token>" first thing on a link, introduces the node
+ * - LINK_INTEREST 1 byte, whether the node has members
+ * - LINK_SUBMIT <fd:4> <hops:1> <message> a chat message from the client
+ *   `fd` of the node, for the room owner to publish; `hops` counts the
+ *   nodes which relayed it, not owning the room, `fd` is -1 once relayed
+ * - LINK_MESSAGE <seq:8> <fd:4> <message> a chat message published by the
+ *   room owner, formatted as sent to the clients; `fd` is the sender when
+ *   it goes back to the node it came from, -1 otherwise
+ * - LINK_HISTORY <seq:8> <message> a past message, on a handoff
+ * - LINK_HANDOFF <seq:8> the room is handed over, see ROOM OWNERSHIP
+ *
+ * A chat message goes to the owner of the room, which delivers it to its
+ * clients and forwards it once to each peer with members, the sender's
+ * node included; they deliver it to their own and don't forward it
+ * further. Frames are not written right away: they pile up in
+ * the link buffer and the event loop writes each link once per
+ * iteration, so a busy node sends many messages per syscall.
+ *
+ * Links that drop are dialed again, straight away if they were up and
+ * then from the housekeeping timer; what was queued on them is lost.
+ */
+
+static void link_queue(Link *l, uint8_t type, const char *data,
+                       size_t len) {
+    char header[LINK_HEADER_LEN] = {type, len >> 8, len & 0xFF};
+    buffer_append(&l->out, header, LINK_HEADER_LEN);
+    buffer_append(&l->out, data, len);
+}
+
+static Link *link_new(Server *server, int fd, int peer, int outbound) {
+    if (fd >= server->config.max_clients) {
+        close(fd);
+        return NULL;
+    }
+    Link *l = cl_malloc(sizeof(Link));
+    *l = (Link){.fd = fd, .peer = peer, .outbound = outbound};
+    // Edge triggered, EPOLLOUT also tells when a dial completes
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(server->epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl: link fd");
+        close(fd);
+        free(l);
+        return NULL;
+    }
+    server->links[fd] = l;
+    return l;
+}
+
+// Open the link to a peer, the connection completes in the event loop
+static void cluster_dial(Server *server, int peer) {
+    Cluster *cl = &server->cluster;
+    Peer *p = &cl->peers[peer];
+    int fd = socket(p->sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    0);
+    if (fd < 0) {
+        perror("cluster: socket");
+        return;
+    }
+    if (connect(fd, (struct sockaddr *)&p->sa, p->salen) < 0 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        return;
+    }
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    Link *l = link_new(server, fd, peer, 1);
+    if (l == NULL)
+        return;
+    p->link = fd;
+    char hello[NODE_MAXLEN + TOKEN_MAXLEN + 2];
+    int len = snprintf(hello, sizeof(hello), "%s %s", cl->node, server->token);
+    link_queue(l, LINK_HELLO, hello, len);
+    uint8_t interest = cl->members > 0;
+    link_queue(l, LINK_INTEREST, (const char *)&interest, 1);
+}
+
+static void put_be32(char *p, uint32_t v) {
+    for (int i = 3; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xFF;
+}
+
+static void put_be64(char *p, uint64_t v) {
+    for (int i = 7; i >= 0; i--, v >>= 8)
+        p[i] = v & 0xFF;
+}
+
+static uint32_t get_be32(const char *p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++)
+        v = (v << 8) | (unsigned char)p[i];
+    return v;
+}
+
+static uint64_t get_be64(const char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = (v << 8) | (unsigned char)p[i];
+    return v;
+}
+
+/*
+ * Queue message `seq` for every peer with members and for the `origin`
+ * one, which gets the fd of the sender
+ */
+static void cluster_forward(Server *server, uint64_t seq, const char *msg,
+                            size_t len, int origin, int fd) {
+    Cluster *cl = &server->cluster;
+    char *frame = arena_alloc(&server->scratch, 12 + len);
+    put_be64(frame, seq);
+    memcpy(frame + 12, msg, len);
+    for (int i = 0; i < cl->npeers; i++) {
+        Peer *p = &cl->peers[i];
+        if (p->link < 0 || !(p->interested || i == origin))
+            continue;
+        put_be32(frame + 8, i == origin ? fd : -1);
+        link_queue(server->links[p->link], LINK_MESSAGE, frame, 12 + len);
+        p->frames++;
+    }
+}
+
+/*
+ * Publish a chat message as the room owner: number it, forward it and
+ * deliver it; `origin` is the peer it comes from, -1 for a local client,
+ * `fd` the sender on that node
+ */
+static void cluster_publish(Server *server, const char *msg, size_t len,
+                            int origin, int fd) {
+    Room *room = &server->cluster.room;
+    uint64_t seq = room->seq + 1;
+    room_remember(room, seq, server->history.next_id);
+    cluster_forward(server, seq, msg, len, origin, fd);
+    deliver_message(server, msg, len, origin < 0 ? fd : -1, LANE_LIVE);
+}
+
+/*
+ * A chat message to be published by the room owner, from the client `fd`
+ * of peer `origin`, -1 for a local one, after `hops` relays. Only the
+ * owner numbers messages: a node which doesn't own the room relays it to
+ * the owner it sees, while views of the ring differ, and the sender gets
+ * its own message back as it's not known anymore past the first relay.
+ * The node publishes it itself when the owner can't be reached, or after
+ * CLUSTER_MAXPEERS relays, views going round in a loop.
+ */
+static void cluster_submit(Server *server, const char *msg, size_t len,
+                           int origin, int fd, uint8_t hops) {
+    Cluster *cl = &server->cluster;
+    int owner = cl->room.owner;
+    if (owner < 0 || cl->peers[owner].link < 0 || hops >= CLUSTER_MAXPEERS) {
+        cluster_publish(server, msg, len, origin, fd);
+        return;
+    }
+    char *frame = arena_alloc(&server->scratch, 5 + len);
+    put_be32(frame, origin < 0 ? fd : -1);
+    frame[4] = origin < 0 ? 0 : hops + 1;
+    memcpy(frame + 5, msg, len);
+    link_queue(server->links[cl->peers[owner].link], LINK_SUBMIT, frame,
+               5 + len);
+}
+
+// Hand the room over to its new owner, with the recent messages
+static void cluster_handoff(Server *server, int peer) {
+    Cluster *cl = &server->cluster;
+    Room *room = &cl->room;
+    Link *l = server->links[cl->peers[peer].link];
+    char *frame = arena_alloc(&server->scratch, 8 + CHAT_MAXLEN);
+    uint64_t first = room->count > HANDOFF_MAX ? room->count - HANDOFF_MAX : 0;
+    for (uint64_t i = first; i < room->count; i++) {
+        const RoomEntry *e = &room->recent[i % HANDOFF_MAX];
+        ssize_t n =
+            history_read(&server->history, e->id, frame + 8, CHAT_MAXLEN);
+        if (n <= 0)
+            continue;
+        put_be64(frame, e->seq);
+        link_queue(l, LINK_HISTORY, frame, 8 + n);
+    }
+    put_be64(frame, room->seq);
+    link_queue(l, LINK_HANDOFF, frame, 8);
+    CL_LOG("Room handed over to %s at %lu\n", cl->peers[peer].addr,
+           room->seq);
+}
+
+// A peer came up or went down, the room may have a new owner
+static void cluster_rebalance(Server *server) {
+    Cluster *cl = &server->cluster;
+    ring_build(cl);
+    int owner = ring_owner(&cl->ring, CHAT_ROOM, strlen(CHAT_ROOM));
+    if (owner == cl->room.owner)
+        return;
+    if (cl->room.owner < 0)
+        cluster_handoff(server, owner);
+    cl->room.owner = owner;
+    CL_LOG("Room owned by %s\n", owner < 0 ? cl->node : cl->peers[owner].addr);
+}
+
+static void link_close(Server *server, Link *l) {
+    Cluster *cl = &server->cluster;
+    if (epoll_ctl(server->epollfd, EPOLL_CTL_DEL, l->fd, NULL) < 0)
+        perror("epoll_ctl: link fd");
+    close(l->fd);
+    server->links[l->fd] = NULL;
+    int redial = 0;
+    if (l->peer >= 0) {
+        Peer *p = &cl->peers[l->peer];
+        if (l->outbound) {
+            p->link = -1;
+            p->up = 0;
+            redial = l->up;
+        } else {
+            p->interested = 0;
+        }
+        CL_LOG("Link %s %s down\n", l->outbound ? "to" : "from", p->addr);
+    }
+    free(l->in.data);
+    free(l->out.data);
+    int peer = l->peer;
+    free(l);
+    if (redial) {
+        cluster_rebalance(server);
+        cluster_dial(server, peer);
+    }
+}
+
+// Write what's batched on a link, CL_ERR if the link is gone
+static int link_flush(Server *server, Link *l) {
+    Peer *p = l->peer >= 0 ? &server->cluster.peers[l->peer] : NULL;
+    while (buffer_pending(&l->out) > 0) {
+        ssize_t n = write(l->fd, l->out.data + l->out.off,
+                          buffer_pending(&l->out));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return CL_ERR;
+            // A peer too slow to keep up is cut off, it'll dial back
+            if (buffer_pending(&l->out) >
+                (size_t)server->config.link_maxpending)
+                return CL_ERR;
+            return CL_OK;
+        }
+        l->out.off += n;
+        if (p)
+            p->writes++;
+    }
+    l->out.off = l->out.len = 0;
+    return CL_OK;
+}
+
+static int cluster_peer(const Cluster *cl, const char *addr, size_t len) {
+    for (int i = 0; i < cl->npeers; i++)
+        if (strlen(cl->peers[i].addr) == len &&
+            memcmp(cl->peers[i].addr, addr, len) == 0)
+            return i;
+    return -1;
+}
+
+// Process a frame received on a link, CL_ERR to drop the link
+static int link_frame(Server *server, Link *l, uint8_t type, char *data,
+                      size_t len) {
+    Cluster *cl = &server->cluster;
+    if (l->outbound)
+        return CL_ERR;
+    if (l->peer < 0) {
+        // Nothing but an introduction with the right token is accepted
+        char *sep = memchr(data, ' ', len);
+        size_t toklen = strlen(server->token);
+        if (type != LINK_HELLO || sep == NULL ||
+            (size_t)(data + len - sep - 1) != toklen ||
+            !token_equal(sep + 1, server->token, toklen))
+            return CL_ERR;
+        l->peer = cluster_peer(cl, data, sep - data);
+        if (l->peer < 0)
+            return CL_ERR;
+        CL_LOG("Link from %s up\n", cl->peers[l->peer].addr);
+        return CL_OK;
+    }
+    switch (type) {
+    case LINK_INTEREST:
+        if (len < 1)
+            return CL_ERR;
+        cl->peers[l->peer].interested = data[0];
+        return CL_OK;
+    case LINK_SUBMIT:
+        if (len <= 5 || len - 5 > CHAT_MAXLEN)
+            return CL_ERR;
+        cluster_submit(server, data + 5, len - 5, l->peer,
+                       (int32_t)get_be32(data), data[4]);
+        return CL_OK;
+    case LINK_MESSAGE:
+        if (len <= 12 || len - 12 > CHAT_MAXLEN)
+            return CL_ERR;
+        room_check(cl, get_be64(data));
+        room_remember(&cl->room, get_be64(data), server->history.next_id);
+        deliver_message(server, data + 12, len - 12,
+                        (int32_t)get_be32(data + 8), LANE_LIVE);
+        return CL_OK;
+    case LINK_HISTORY:
+        if (len <= 8 || len - 8 > CHAT_MAXLEN)
+            return CL_ERR;
+        // Only what this node missed
+        if (get_be64(data) > cl->room.seq) {
+            room_remember(&cl->room, get_be64(data), server->history.next_id);
+            deliver_message(server, data + 8, len - 8, -1, LANE_LIVE);
+        }
+        return CL_OK;
+    case LINK_HANDOFF:
+        if (len != 8)
+            return CL_ERR;
+        if (get_be64(data) > cl->room.seq)
+            cl->room.seq = get_be64(data);
+        CL_LOG("Room handed over by %s at %lu\n", cl->peers[l->peer].addr,
+               cl->room.seq);
+        return CL_OK;
+    }
+    return CL_ERR;
+}
+
+// Read and process everything available on a link
+static void link_read(Server *server, Link *l) {
+    char buf[LINK_READ_CHUNK];
+    for (;;) {
+        ssize_t n = read(l->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {
+            link_close(server, l);
+            return;
+        }
+        buffer_append(&l->in, buf, n);
+    }
+
+    Buffer *in = &l->in;
+    while (buffer_pending(in) >= LINK_HEADER_LEN) {
+        unsigned char *h = (unsigned char *)in->data + in->off;
+        size_t len = (h[1] << 8) | h[2];
+        if (buffer_pending(in) < LINK_HEADER_LEN + len)
+            break;
+        in->off += LINK_HEADER_LEN + len;
+        if (link_frame(server, l, h[0], (char *)h + LINK_HEADER_LEN, len) ==
+            CL_ERR) {
+            link_close(server, l);
+            return;
+        }
+    }
+    // Keep just the incomplete frame
+    memmove(in->data, in->data + in->off, buffer_pending(in));
+    in->len -= in->off;
+    in->off = 0;
+}
+
+static void link_event(Server *server, Link *l, uint32_t events) {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        link_close(server, l);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        if (!l->up && l->outbound && l->peer >= 0) {
+            server->cluster.peers[l->peer].up = 1;
+            l->up = 1;
+            cluster_rebalance(server);
+        }
+        l->up = 1;
+        if (link_flush(server, l) == CL_ERR) {
+            link_close(server, l);
+            return;
+        }
+    }
+    if (events & EPOLLIN)
+        link_read(server, l);
+}
+
+static void cluster_accept(Server *server) {
+    int fd;
+    while ((fd = accept4(server->cluster.fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+        (void)link_new(server, fd, -1, 0);
+}
+
+/*
+ * Once per event loop iteration: tell the peers if the node gained its
+ * first member or lost its last one, then write out what's batched
+ */
+static void cluster_flush(Server *server) {
+    Cluster *cl = &server->cluster;
+    uint8_t interest = cl->members > 0;
+    for (int i = 0; i < cl->npeers; i++) {
+        Peer *p = &cl->peers[i];
+        if (p->link < 0)
+            continue;
+        Link *l = server->links[p->link];
+        if (interest != cl->advertised)
+            link_queue(l, LINK_INTEREST, (const char *)&interest, 1);
+        if (l->up && buffer_pending(&l->out) > 0 &&
+            link_flush(server, l) == CL_ERR)
+            link_close(server, l);
+    }
+    cl->advertised = interest;
+}
+
+// Dial the peers not linked, on startup and from the housekeeping timer
+static void cluster_redial(Server *server) {
+    for (int i = 0; i < server->cluster.npeers; i++)
+        if (server->cluster.peers[i].link < 0)
+            cluster_dial(server, i);
+}
+
+static int cluster_resolve(const char *addr, struct sockaddr_storage *sa,
+                           socklen_t *salen) {
+    char host[NODE_MAXLEN];
+    snprintf(host, sizeof(host), "%s", addr);
+    char *port = strrchr(host, ':');
+    if (port == NULL)
+        return CL_ERR;
+    *port++ = '\0';
+    const struct addrinfo hints = {.ai_family = AF_UNSPEC,
+                                   .ai_socktype = SOCK_STREAM};
+    struct addrinfo *result;
+    if (getaddrinfo(host, port, &hints, &result) != 0)
+        return CL_ERR;
+    memcpy(sa, result->ai_addr, result->ai_addrlen);
+    *salen = result->ai_addrlen;
+    freeaddrinfo(result);
+    return CL_OK;
+}
+
+// Set the cluster up from the cluster and peers options
+static int cluster_init(Cluster *cl, const Config *cfg) {
+    cl->fd = -1;
+    cl->room.owner = -1;
+    if (cfg->cluster[0] == '\0')
+        return CL_OK;
+    snprintf(cl->node, sizeof(cl->node), "%s", cfg->cluster);
+
+    const char *peers = cfg->peers;
+    while (peers && *peers) {
+        size_t len = strcspn(peers, ",");
+        if (len > 0 && len < NODE_MAXLEN) {
+            if (cl->npeers == CLUSTER_MAXPEERS) {
+                fprintf(stderr, "cluster: too many peers\n");
+                return CL_ERR;
+            }
+            Peer *p = &cl->peers[cl->npeers];
+            memcpy(p->addr, peers, len);
+            p->addr[len] = '\0';
+            p->link = -1;
+            if (cluster_resolve(p->addr, &p->sa, &p->salen) == CL_ERR) {
+                fprintf(stderr, "cluster: can't resolve %s\n", p->addr);
+                return CL_ERR;
+            }
+            cl->npeers++;
+        }
+        peers += len + (peers[len] == ',');
+    }
+    return CL_OK;
+}
+
+// Listen for links, unless handed over by an upgrade, and dial the peers
+static int cluster_start(Server *server) {
+    Cluster *cl = &server->cluster;
+    if (cl->node[0] == '\0')
+        return CL_OK;
+    if (cl->fd < 0) {
+        char host[NODE_MAXLEN];
+        snprintf(host, sizeof(host), "%s", cl->node);
+        char *port = strrchr(host, ':');
+        if (port == NULL) {
+            fprintf(stderr, "cluster: invalid address %s\n", cl->node);
+            return CL_ERR;
+        }
+        *port++ = '\0';
+        cl->fd = cl_listen(host, atoi(port), server->config.backlog);
+        if (cl->fd == CL_ERR) {
+            fprintf(stderr, "Error listening on %s\n", cl->node);
+            return CL_ERR;
+        }
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = cl->fd;
+    if (epoll_ctl(server->epollfd, EPOLL_CTL_ADD, cl->fd, &ev) == -1) {
+        perror("epoll_ctl: cluster fd");
+        return CL_ERR;
+    }
+    CL_LOG("Cluster node %s, %d peers\n", cl->node, cl->npeers);
+    cluster_redial(server);
+    return CL_OK;
+}
+
+/*
+ * Format a message and send it to everyone on `lane`, `fd` being the
+ * sender or -1 for server messages, on any lane but the live one; chat
+ * messages go through the room owner when clustered
+ */
+void broadcast_message(Server *server, const char *buf, size_t len, int fd,
+                       int lane) {
+    int server_info = lane != LANE_LIVE;
+    const Atom *from =
+        server_info ? server->server_nick : server->clients[fd]->nick;
+    size_t msglen = atom_header_len(from);
+    char *msg = arena_alloc(&server->scratch, msglen + len);
+    memcpy(msg, atom_header(from), msglen);
+    memcpy(msg + msglen, buf, len);
+    msglen += len;
+
+    if (server_info)
+        deliver_message(server, msg, msglen, fd, lane);
+    else
+        cluster_submit(server, msg, msglen, -1, fd, 0);
+}
+
+/*
+ * Append to `str` the nicks of a notice set, as many as fit in `cap` more
+ * bytes, see arena_catf
+ */
+static char *notices_format(Arena *a, char *str, size_t *len, size_t cap,
+                            const AtomSet *s, const char *verb) {
+    if (s->len == 0)
+        return str;
+    if (s->len == 1)
+        return arena_catf(a, str, len, "%s %s\n", s->items[0]->str, verb);
+    size_t end = *len + cap;
+    str = arena_catf(a, str, len, "%u users %s:", s->len, verb);
+    for (uint32_t i = 0; i < s->len; i++) {
+        const Atom *nick = s->items[i];
+        // Room for the separator, the nick, an ellipsis and the newline
+        if (*len + 2 + nick->len + 5 + 1 > end) {
+            str = arena_catf(a, str, len, ", ...");
+            break;
+        }
+        str = arena_catf(a, str, len, "%s%s", i ? ", " : " ", nick->str);
+    }
+    return arena_catf(a, str, len, "\n");
+}
+
+// Broadcast the notices of the window just closed and size the next one
+static void notices_flush(Server *server) {
+    Notices *n = &server->notices;
+    // Each list gets half of the room left after the sender header
+    size_t half =
+        (MESSAGE_MAXLEN - 1 - atom_header_len(server->server_nick)) / 2;
+    char *buf = NULL;
+    size_t len = 0;
+    buf = notices_format(&server->scratch, buf, &len, half, &n->joined,
+                         "joined");
+    buf = notices_format(&server->scratch, buf, &len, half, &n->left, "left");
+    if (len > 0) {
+        broadcast_message(server, buf, len, -1, LANE_NOTICE);
+        n->sent++;
+    }
+
+    for (uint32_t i = 0; i < n->joined.len; i++)
+        atom_release(&server->interns, n->joined.items[i]);
+    for (uint32_t i = 0; i < n->left.len; i++)
+        atom_release(&server->interns, n->left.items[i]);
+    n->joined.len = n->left.len = 0;
+
+    const Config *cfg = &server->config;
+    if (n->events > (uint32_t)cfg->notices_burst &&
+        n->window < (uint32_t)cfg->notices_window_max)
+        n->window *= 2;
+    else if (n->events < (uint32_t)cfg->notices_burst / 4 &&
+             n->window > (uint32_t)cfg->notices_window)
+        n->window /= 2;
+    n->events = 0;
+}
+
+/*
+ * =====================================================
+ *                 AUTHENTICATION
+ * =====================================================
+ *
+ * A new connection isn't a client yet: it must first present the server
+ * token with
+ *
+ * /auth <token>
+ *
+ * or a session resume token (see SESSION RESUME) within auth_timeout
+ * seconds. Until then it costs just a slot in the
+ * `preauth` array, which also holds the auth line while it comes in
+ * pieces, up to AUTH_MAXLEN bytes: no allocation happens and nothing is
+ * broadcast to or from it, so scanners and bots hammering the port are
+ * cheap to carry.
+ * Any other input, a wrong token or a timeout close the connection.
+ */
+
+// A connection accepted on `listener`, local ones on the Unix socket skip TLS
+static void preauth_add(Server *server, int fd, int listener) {
+#ifdef HAVE_TLS
+    if (server->tls_ctx && listener != server->unix_fd &&
+        tls_accept(server, fd) == CL_ERR) {
+        close(fd);
+        return;
+    }
+#endif
+    if (listener == server->ws_fd)
+        ws_accept(server, fd);
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(server->epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl: client fd");
+        close(fd);
+        return;
+    }
+    server->preauth[fd] = (Preauth){
+        .deadline = now_ms() / 1000 + server->config.auth_timeout};
+}
+
+static void preauth_close(Server *server, int fd) {
+    if (epoll_ctl(server->epollfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+        perror("epoll_ctl: client fd");
+#ifdef HAVE_TLS
+    tls_free(server, fd);
+#endif
+    ws_free(server, fd);
+    close(fd);
+    server->preauth[fd].deadline = 0;
+}
+
+// Drop connections that didn't authenticate in time
+static void preauth_expire(Server *server) {
+    uint32_t now = now_ms() / 1000;
+    for (int fd = 0; fd < server->config.max_clients; fd++) {
+        uint32_t deadline = server->preauth[fd].deadline;
+        if (deadline == 0 || deadline > now)
+            continue;
+        CL_LOG("Auth timeout fd=%i\n", fd);
+        preauth_close(server, fd);
+    }
+}
+
+/*
+ * Turn an authenticated connection into a proper client and welcome it,
+ * everyone learns it joined through JOIN NOTICES, its friends that it's
+ * online through PRESENCE. A resumed session gets its nick back and the
+ * messages it missed.
+ */
+static void client_admit(Server *server, int fd, const Session *resumed) {
+    char *buf;
+    size_t buflen;
+    Client *c = client_new(server, fd);
+    if (c == NULL) {
+        close(fd);
+        return;
+    }
+    server->stats.connections++;
+
+    if (resumed) {
+        (void)client_set_nick(server, c, resumed->nick,
+                              strlen(resumed->nick));
+        memcpy(c->session, resumed->token, sizeof(c->session));
+        uint64_t missed = server->history.next_id - resumed->synced;
+        CL_LOG("User %s resumed, %lu messages missed\n", c->nick->str,
+               missed);
+        buf = arena_catf(&server->scratch, NULL, &buflen,
+                         "Server\r\nWelcome back %s!\n", c->nick->str);
+        if (client_send_message(server, c, LANE_CONTROL, buf, buflen) ==
+            CL_ERR)
+            perror("write welcome message");
+        history_seek(&server->history, &c->replay, missed);
+        if (client_flush(server, c) == CL_ERR)
+            perror("resume replay");
+    } else {
+        generate_random_token(c->session, RESUME_TOKEN_LEN);
+        CL_LOG("New user %s connected\n", c->nick->str);
+
+        // Let's send a welcome message
+        buf = arena_catf(&server->scratch, NULL, &buflen,
+                         "Server\r\nWelcome %s! Use /nick to set a "
+                         "nickname\nServer\r\nUse /resume %s to resume this "
+                         "session\n\n",
+                         c->nick->str, c->session);
+        if (client_send_message(server, c, LANE_CONTROL, buf, buflen) ==
+            CL_ERR)
+            perror("write welcome message");
+    }
+    notices_join(server, c->nick);
+}
+
+static void preauth_read(Server *server, int fd) {
+#ifdef HAVE_TLS
+    if (tls_handshaking(server, fd)) {
+        int rc = tls_handshake(server, fd);
+        if (rc == CL_ERR) {
+            CL_LOG("TLS handshake failed fd=%i\n", fd);
+            preauth_close(server, fd);
+        }
+        if (rc != CL_OK)
+            return;
+    }
+#endif
+    // A line that came in pieces is completed with what's read now
+    Preauth *p = &server->preauth[fd];
+    char buf[AUTH_MAXLEN];
+    memcpy(buf, p->line, p->len);
+    ssize_t nread;
+    if (server->ws[fd]) {
+        Buffer reply = {0};
+        nread = ws_recv(server, fd, buf, sizeof(buf), &reply);
+        if (reply.len > 0)
+            (void)cl_write(server, fd, reply.data, reply.len);
+        free(reply.data);
+        if (nread == 0)
+            return;
+    } else {
+        nread = cl_read(server, fd, buf + p->len, sizeof(buf) - 1 - p->len);
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+    }
+    if (nread <= 0) {
+        preauth_close(server, fd);
+        return;
+    }
+    size_t len = p->len + nread;
+    buf[len] = '\0';
+
+    // Only the first line authenticates, what follows it is client input.
+    // Raw input may stop short of it, WebSocket messages come whole.
+    char *nl = memchr(buf, '\n', len);
+    if (nl == NULL && server->ws[fd] == NULL && len < sizeof(buf) - 1) {
+        memcpy(p->line, buf, len);
+        p->len = len;
+        return;
+    }
+    p->len = 0;
+    size_t linelen = nl ? (size_t)(nl - buf) + 1 : len;
+    char next = buf[linelen];
+    buf[linelen] = '\0';
+
+    size_t token_len = strlen(server->token);
+    Session session, *resumed = NULL;
+    int authenticated = 0;
+    if (strncmp(buf, "/auth ", 6) == 0) {
+        char *token = trim_string(buf + 6);
+        authenticated = strlen(token) == token_len &&
+                        token_equal(token, server->token, token_len);
+    } else if (strncmp(buf, "/resume ", 8) == 0) {
+        char *token = trim_string(buf + 8);
+        if (sessions_take(&server->sessions, token, &session) == CL_OK)
+            resumed = &session;
+        authenticated = resumed != NULL;
+    }
+    if (!authenticated) {
+        const char *msg = "Server\r\nAuthentication failed\n";
+        size_t len;
+        const char *frame = message_encode(
+            server, server->ws[fd] ? ENCODING_WEBSOCKET : ENCODING_PLAIN, msg,
+            strlen(msg), &len);
+        CL_LOG("Auth failed fd=%i\n", fd);
+        (void)cl_write(server, fd, frame, len);
+        preauth_close(server, fd);
+        return;
+    }
+
+    // Hand the connection over to the client logic
+    if (epoll_ctl(server->epollfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+        perror("epoll_ctl: client fd");
+    p->deadline = 0;
+    client_admit(server, fd, resumed);
+    Client *c = server->clients[fd];
+    if (c == NULL)
+        return;
+    if (len > linelen) {
+        buf[linelen] = next;
+        buffer_append(&c->in, buf + linelen, len - linelen);
+        client_charge(server, c);
+    }
+    // WebSocket frames or TLS records may already be buffered after the
+    // auth line, edge triggered epoll won't tell about them
+    loop_requeue(&server->loop, c);
+}
+
+/*
+ * =====================================================
+ *                 FILE TRANSFER
+ * =====================================================
+ *
+ * A client offers a file to another with /send <nick> <size>, followed by
+ * exactly <size> raw bytes, the recipient being told
+ *
+ *     Server\r\n<nick> wants to send <size> bytes, /accept to take it\n
+ *
+ * The bytes never go through userspace: they're spliced from the sender
+ * socket into a pipe and, once the recipient accepted, from the pipe into
+ * the recipient socket. It gets them in pieces, as much as the pipe holds
+ * at a time, each right after a
+ *
+ *     Server\r\n<nick> sends <n> bytes\n
+ *
+ * header. Both sides are pumped in turn until neither makes progress, so
+ * the pipe provides flow control: a full pipe stops the reads from the
+ * sender until the recipient socket takes some, an empty one waits for
+ * the sender socket. The pump runs from client_read for either client,
+ * when its socket is ready or it's put on the ready list.
+ *
+ * The recipient output is only put on hold while a piece is written out,
+ * a piece starting once everything queued for it before is out, so chat
+ * goes on between pieces however slow the sender is. A transfer nothing
+ * moved for in transfer_idle seconds is aborted, see transfer_expire. If
+ * the sender is gone half way the recipient gets what's in the pipe, a
+ * notice after it telling the transfer failed; if the recipient is gone
+ * the rest of the file is discarded. Raw TCP and Unix socket clients
+ * only, as well as TLS ones fully offloaded to kTLS, with plain output:
+ * /compress is refused while taking part in a transfer.
+ */
+
+// Whether a client socket can take part in a transfer
+static int transfer_capable(const Server *server, const Client *c) {
+    if (server->ws[c->fd] || c->transfer || c->switching)
+        return 0;
+#ifdef HAVE_TLS
+    return server->tls[c->fd] == NULL ||
+           server->ktls[c->fd] == (KTLS_TX | KTLS_RX);
+#else
+    return 1;
+#endif
+}
+
+/*
+ * Start relaying a file from a client, `args` being the rest of its /send
+ * line, returns CL_ERR if it can't be sent
+ */
+static int transfer_open(Server *server, Client *c, char *args) {
+    char nick[NICK_MAXLEN];
+    uint64_t size;
+    if (sscanf(args, "%31s %lu", nick, &size) != 2 || size == 0)
+        return CL_ERR;
+    const Atom *a = atom_lookup(&server->interns, nick, strlen(nick));
+    Client *r = a && a->contact ? a->contact->clients : NULL;
+    if (r == NULL || r == c || !transfer_capable(server, c) ||
+        !transfer_capable(server, r) || r->encoding != ENCODING_PLAIN)
+        return CL_ERR;
+
+    Transfer *tr = cl_malloc(sizeof(Transfer));
+    *tr = (Transfer){.from = c->fd,
+                     .to = r->fd,
+                     .size = size,
+                     .left = size,
+                     .active = now_ms() / 1000};
+    if (pipe2(tr->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe2");
+        free(tr);
+        return CL_ERR;
+    }
+    // Not fatal, the pipe just takes less at a time
+    (void)fcntl(tr->pipe[1], F_SETPIPE_SZ, TRANSFER_PIPE);
+    memcpy(tr->from_nick, c->nick->str, c->nick->len + 1);
+    memcpy(tr->to_nick, r->nick->str, r->nick->len + 1);
+    c->transfer = r->transfer = tr;
+    CL_LOG("User %s sending %lu bytes to %s\n", tr->from_nick, size,
+           tr->to_nick);
+    size_t msglen;
+    char *msg = arena_catf(&server->scratch, NULL, &msglen,
+                           "Server\r\n%s wants to send %lu bytes, /accept "
+                           "to take it\n",
+                           tr->from_nick, size);
+    (void)client_send_message(server, r, LANE_CONTROL, msg, msglen);
+    return CL_OK;
+}
+
+// The recipient takes the file offered, returns CL_ERR if there's none
+static int transfer_accept(Server *server, Client *c) {
+    Transfer *tr = c->transfer;
+    if (tr == NULL || tr->to != c->fd || tr->accepted)
+        return CL_ERR;
+    tr->accepted = 1;
+    tr->active = now_ms() / 1000;
+    loop_requeue(&server->loop, c);
+    return CL_OK;
+}
+
+/*
+ * Bytes of the file the sender wrote along with its /send line, already
+ * read; they fit in the pipe, still empty
+ */
+static int transfer_feed(Transfer *tr, const char *data, size_t len) {
+    if (write(tr->pipe[1], data, len) != (ssize_t)len)
+        return CL_ERR;
+    tr->left -= len;
+    tr->inpipe += len;
+    return CL_OK;
+}
+
+/*
+ * Tell the two ends how it went and hand their sockets back, returns CL_ERR
+ * if the recipient is gone flushing what waited for it
+ */
+static int transfer_close(Server *server, Transfer *tr) {
+    Client *from = tr->from >= 0 ? server->clients[tr->from] : NULL;
+    Client *to = tr->to >= 0 ? server->clients[tr->to] : NULL;
+    Arena *a = &server->scratch;
+    char *msg;
+    size_t msglen;
+    CL_LOG("Transfer from %s to %s done\n", tr->from_nick, tr->to_nick);
+    if (from) {
+        from->transfer = NULL;
+        if (to)
+            msg = arena_catf(a, NULL, &msglen,
+                             "Server\r\nSent %lu bytes to %s\n", tr->size,
+                             tr->to_nick);
+        else
+            msg = arena_catf(a, NULL, &msglen,
+                             "Server\r\nTransfer to %s failed\n",
+                             tr->to_nick);
+        (void)client_send_message(server, from, LANE_CONTROL, msg, msglen);
+        // What it sent after the file is lines again
+        loop_requeue(&server->loop, from);
+    }
+    if (to) {
+        to->transfer = NULL;
+        if (from == NULL) {
+            msg = arena_catf(a, NULL, &msglen,
+                             "Server\r\nTransfer from %s failed\n",
+                             tr->from_nick);
+            (void)client_send_message(server, to, LANE_CONTROL, msg, msglen);
+        }
+    }
+    close(tr->pipe[0]);
+    close(tr->pipe[1]);
+    free(tr);
+    if (to && client_flush(server, to) == CL_ERR) {
+        client_detach(server, to);
+        return CL_ERR;
+    }
+    return CL_OK;
+}
+
+/*
+ * Move the file of the transfer `c` takes part in from the sender to the
+ * recipient, at most TRANSFER_BUDGET bytes of it in a go, until neither
+ * socket is ready; returns CL_ERR if `c` is gone after it.
+ */
+static int transfer_pump(Server *server, Client *c) {
+    static char sink[4096];
+    Transfer *tr = c->transfer;
+    Client *r = tr->to >= 0 ? server->clients[tr->to] : NULL;
+    size_t budget = TRANSFER_BUDGET;
+    int self = c->fd;
+    int moved = 0;
+
+    // Gone before the recipient took it, there's nothing to hand over
+    if (tr->from < 0 && !tr->accepted) {
+        if (transfer_close(server, tr) == CL_ERR && r == c)
+            return CL_ERR;
+        return CL_OK;
+    }
+    for (;;) {
+        ssize_t in = 0, out = 0;
+        if (tr->from >= 0 && tr->left > 0 && budget > 0) {
+            size_t want = tr->left < budget ? tr->left : budget;
+            in = splice(tr->from, NULL, tr->pipe[1], NULL, want,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            // Hung up or failed, writing to the pipe just can't
+            if (in == 0 || (in < 0 && errno != EAGAIN)) {
+                int gone = tr->from;
+                client_detach(server, server->clients[gone]);
+                return gone == self ? CL_ERR : CL_OK;
+            }
+            if (in > 0) {
+                tr->left -= in;
+                tr->inpipe += in;
+                budget -= in;
+            }
+        }
+        // The next piece, once what was queued for the recipient is out
+        if (r && tr->accepted && tr->piece == 0 && tr->inpipe > 0 &&
+            client_pending(r) == 0 && r->replay.sent == 0) {
+            tr->piece = tr->inpipe;
+            tr->headlen = snprintf(tr->head, sizeof(tr->head),
+                                   "Server\r\n%s sends %zu bytes\n",
+                                   tr->from_nick, tr->piece);
+            tr->headsent = 0;
+        }
+        if (r == NULL && tr->inpipe > 0) {
+            out = read(tr->pipe[0], sink, sizeof(sink));
+            if (out > 0)
+                tr->inpipe -= out;
+        } else if (tr->headsent < tr->headlen) {
+            out = write(tr->to, tr->head + tr->headsent,
+                        tr->headlen - tr->headsent);
+            if (out > 0)
+                tr->headsent += out;
+        } else if (tr->piece > 0) {
+            out = splice(tr->pipe[0], NULL, tr->to, NULL, tr->piece,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (out > 0) {
+                tr->piece -= out;
+                tr->inpipe -= out;
+            }
+        }
+        if (out < 0 && errno != EAGAIN) {
+            int gone = tr->to;
+            client_detach(server, r);
+            return gone == self ? CL_ERR : CL_OK;
+        }
+        if (in <= 0 && out <= 0)
+            break;
+        moved = 1;
+    }
+
+    if (moved)
+        tr->active = now_ms() / 1000;
+    if ((tr->left == 0 || tr->from < 0) && tr->inpipe == 0) {
+        int to = tr->to;
+        if (transfer_close(server, tr) == CL_ERR && to == self)
+            return CL_ERR;
+        return CL_OK;
+    }
+    // Out of budget with both sockets still ready
+    if (budget == 0)
+        loop_requeue(&server->loop, c);
+    if (r == NULL)
+        return CL_OK;
+    // Between pieces what was sent to the recipient meanwhile goes out
+    if (!client_receiving(r) && client_pending(r) > 0) {
+        if (client_flush(server, r) == CL_ERR) {
+            int gone = r->fd;
+            client_detach(server, r);
+            return gone == self ? CL_ERR : CL_OK;
+        }
+        return CL_OK;
+    }
+    client_update_events(server, r);
+    return CL_OK;
+}
+
+/*
+ * Abort the transfers nothing moved for in transfer_idle seconds, from
+ * the housekeeping timer: a recipient that didn't accept is let go, one
+ * that doesn't take what's in the pipe is dropped, else the sender is.
+ */
+static void transfer_expire(Server *server) {
+    uint32_t now = now_ms() / 1000;
+    uint32_t idle = server->config.transfer_idle;
+    for (int fd = 0; fd < server->config.max_clients; fd++) {
+        Client *c = server->clients[fd];
+        Transfer *tr = c ? c->transfer : NULL;
+        // Once per transfer, from the sender unless it's gone
+        if (tr == NULL || (tr->from >= 0 && tr->from != fd) ||
+            tr->active + idle > now)
+            continue;
+        Client *r = tr->to >= 0 ? server->clients[tr->to] : NULL;
+        tr->active = now;
+        CL_LOG("Transfer from %s to %s idle\n", tr->from_nick, tr->to_nick);
+        if (r && tr->accepted && tr->inpipe > 0) {
+            client_detach(server, r);
+        } else if (r && tr->from >= 0 && !tr->accepted) {
+            size_t msglen;
+            char *msg = arena_catf(&server->scratch, NULL, &msglen,
+                                   "Server\r\nTransfer from %s expired\n",
+                                   tr->from_nick);
+            r->transfer = NULL;
+            tr->to = -1;
+            (void)client_send_message(server, r, LANE_CONTROL, msg, msglen);
+            // The rest of the file is discarded
+            loop_requeue(&server->loop, c);
+        } else if (tr->from >= 0) {
+            client_detach(server, c);
+        } else {
+            loop_requeue(&server->loop, c);
+        }
+    }
+}
+
+/*
+ * =====================================================
+ *                 COMMANDS
+ * =====================================================
+ *
+ * Anything a client sends is either a command or a chat message to
+ * broadcast:
+ *
+ * - /nick <nick> set the nickname
+ * - /history [N] replay the last N messages
+ * - /compress deflate <dictionary id> compress the output, see COMPRESSION
+ * - /friend <nick>, /unfriend <nick> follow the presence of a nick or
+ *   stop doing it, see PRESENCE
+ * - /friends the friend list, online friends marked with a *
+ * - /stats server counters, /stats loop the event loop ones and /stats
+ *   memory the memory charged to clients
+ * - /send <nick> <size> send a file, /accept take the one offered, see
+ *   FILE TRANSFER
+ * - /quit leave the chat
+ */
+
+static const char *const command_names[CMDS] = {
+    [CMD_QUIT] = "/quit",         [CMD_NICK] = "/nick",
+    [CMD_HISTORY] = "/history",   [CMD_COMPRESS] = "/compress",
+    [CMD_STATS] = "/stats",       [CMD_FRIEND] = "/friend",
+    [CMD_UNFRIEND] = "/unfriend", [CMD_FRIENDS] = "/friends",
+    [CMD_SEND] = "/send",         [CMD_ACCEPT] = "/accept"};
+
+// Intern the command names, and the sender of server notices
+static void commands_init(Server *server) {
+    for (int i = 0; i < CMDS; i++)
+        server->commands[i] = intern(&server->interns, command_names[i],
+                                     strlen(command_names[i]));
+    server->server_nick = intern(&server->interns, "Server", 6);
+}
+
+/*
+ * The command atom of the first word of a line, NULL if it's not one: the
+ * intern table is shared with nicks, which can start with a slash too
+ */
+static const Atom *command_lookup(const Server *server, const char *buf) {
+    if (buf[0] != '/')
+        return NULL;
+    const Atom *a =
+        atom_lookup(&server->interns, buf, strcspn(buf, " \t\r\n"));
+    for (int i = 0; a && i < CMDS; i++)
+        if (server->commands[i] == a)
+            return a;
+    return NULL;
+}
+
+/*
+ * Process a line, or a WebSocket message, a client sent, `buf` being nul
+ * terminated, returns CL_ERR if the client is gone after it. Commands are
+ * told apart by the atom of their first word, arguments follow it.
+ */
+static int client_command(Server *server, Client *c, char *buf, size_t len) {
+    const Atom *cmd = command_lookup(server, buf);
+
+    if (cmd == NULL) {
+        CL_LOG("User: %s len: %li msg: %s", c->nick->str, len, buf);
+        broadcast_message(server, buf, len, c->fd, LANE_LIVE);
+    } else if (cmd == server->commands[CMD_QUIT]) {
+        // Client wants to disconnect here, with what it got so far
+        CL_LOG("User %s disconnected\n", c->nick->str);
+        (void)client_write_lanes(server, c);
+        client_free(server, c);
+        return CL_ERR;
+    } else if (cmd == server->commands[CMD_NICK]) {
+        char *nick = trim_string(buf + cmd->len);
+        if (*nick == '\0')
+            return CL_OK;
+        CL_LOG("User %s updating nick to %s\n", c->nick->str, nick);
+        if (client_set_nick(server, c, nick, strlen(nick)) == CL_ERR) {
+            const char *reply = "Server\r\nInvalid nick\n";
+            if (client_send_message(server, c, LANE_CONTROL, reply,
+                                    strlen(reply)) == CL_ERR) {
+                client_detach(server, c);
+                return CL_ERR;
+            }
+        }
+    } else if (cmd == server->commands[CMD_HISTORY]) {
+        // Replay the last N messages through the client cursor, paced by
+        // the socket
+        if (history_replaying(&c->replay))
+            return CL_OK;
+        long count = strtol(buf + cmd->len, NULL, 10);
+        if (count <= 0)
+            count = server->config.history_default;
+        history_seek(&server->history, &c->replay, count);
+        CL_LOG("User %s requested %lu history messages\n", c->nick->str,
+               c->replay.end - c->replay.next);
+        if (client_flush(server, c) == CL_ERR) {
+            client_detach(server, c);
+            return CL_ERR;
+        }
+    } else if (cmd == server->commands[CMD_COMPRESS]) {
+        // Switched once everything queued before is out, see client_switch
+        char codec[16] = {0};
+        unsigned int dict_id = 0;
+        int ok = sscanf(buf + cmd->len, "%15s %x", codec, &dict_id) == 2 &&
+                 strcmp(codec, "deflate") == 0 &&
+                 dict_id == server->compressor.dict_id &&
+                 c->encoding == ENCODING_PLAIN && c->transfer == NULL;
+        CL_LOG("User %s compression %s\n", c->nick->str,
+               ok ? "on" : "refused");
+        if (ok) {
+            c->switching = ENCODING_DEFLATE;
+            loop_dirty(&server->loop, c);
+            return CL_OK;
+        }
+        const char *reply = "Server\r\nCompression unavailable\n";
+        if (client_send_message(server, c, LANE_CONTROL, reply,
+                                strlen(reply)) == CL_ERR) {
+            client_detach(server, c);
+            return CL_ERR;
+        }
+    } else if (cmd == server->commands[CMD_FRIEND] ||
+               cmd == server->commands[CMD_UNFRIEND]) {
+        char *arg = trim_string(buf + cmd->len);
+        size_t arglen = strlen(arg);
+        if (arglen == 0)
+            return CL_OK;
+        if (arglen >= (size_t)server->config.nick_maxlen)
+            arglen = server->config.nick_maxlen - 1;
+        Atom *nick = intern(&server->interns, arg, arglen);
+        Arena *a = &server->scratch;
+        char *msg;
+        size_t msglen;
+        if (cmd == server->commands[CMD_UNFRIEND]) {
+            presence_unfollow(server, c->nick, nick);
+            msg = arena_catf(a, NULL, &msglen, "Server\r\n%s unfriended\n",
+                             nick->str);
+        } else if (nick == c->nick ||
+                   presence_follow(server, c->nick, nick) == CL_ERR) {
+            msg = arena_catf(a, NULL, &msglen, "Server\r\nCan't friend %s\n",
+                             nick->str);
+        } else {
+            CL_LOG("User %s friended %s\n", c->nick->str, nick->str);
+            msg = arena_catf(a, NULL, &msglen, "Server\r\n%s is %s\n",
+                             nick->str,
+                             nick->contact->online ? "online" : "offline");
+        }
+        atom_release(&server->interns, nick);
+        if (client_send_message(server, c, LANE_CONTROL, msg, msglen) ==
+            CL_ERR) {
+            client_detach(server, c);
+            return CL_ERR;
+        }
+    } else if (cmd == server->commands[CMD_FRIENDS]) {
+        Arena *a = &server->scratch;
+        size_t msglen;
+        char *msg = arena_catf(a, NULL, &msglen, "Server\r\nFriends:");
+        const Contact *ct = c->nick->contact;
+        for (uint32_t i = 0; i < ct->friends.len; i++) {
+            const Atom *f = ct->friends.items[i];
+            msg = arena_catf(a, msg, &msglen, " %s%s", f->str,
+                             f->contact->online ? "*" : "");
+        }
+        msg = arena_catf(a, msg, &msglen, "\n");
+        if (client_send_message(server, c, LANE_CONTROL, msg, msglen) ==
+            CL_ERR) {
+            client_detach(server, c);
+            return CL_ERR;
+        }
+    } else if (cmd == server->commands[CMD_STATS] &&
+               strcmp(trim_string(buf + cmd->len), "loop") == 0) {
+        Arena *a = &server->scratch;
+        size_t msglen;
+        char *msg = arena_catf(a, NULL, &msglen, "Server\r\n");
+        msg = loop_format(&server->loop, a, msg, &msglen);
+        msg = arena_catf(a, msg, &msglen, "\n");
+        if (client_send_message(server, c, LANE_CONTROL, msg, msglen) ==
+            CL_ERR) {
+            client_detach(server, c);
+            return CL_ERR;
+        }
+    } else if (cmd == server->commands[CMD_STATS] &&
+               strcmp(trim_string(buf + cmd->len), "memory") == 0) {
+        Arena *a = &server->scratch;
+        size_t msglen;
+        char *msg = arena_catf(a, NULL, &msglen, "Server\r\n");
+        msg = memory_format(server, msg, &msglen);
+        msg = arena_catf(a, msg, &msglen, "\n");
+        if (client_send_message(server, c, LANE_CONTROL, msg, msglen) ==
+            CL_ERR) {
+            client_detach(server, c);
+            return CL_ERR;
+        }
+    } else if (cmd == server->commands[CMD_SEND]) {
+        // On success the file bytes follow, see client_dispatch
+        if (transfer_open(server, c, buf + cmd->len) == CL_ERR) {
+            const char *reply = "Server\r\nCan't send\n";
+            if (client_send_message(server, c, LANE_CONTROL, reply,
+                                    strlen(reply)) == CL_ERR) {
+                client_detach(server, c);
+                return CL_ERR;
+            }
+        }
+    } else if (cmd == server->commands[CMD_ACCEPT]) {
+        if (transfer_accept(server, c) == CL_ERR) {
+            const char *reply = "Server\r\nNothing to accept\n";
+            if (client_send_message(server, c, LANE_CONTROL, reply,
+                                    strlen(reply)) == CL_ERR) {
+                client_detach(server, c);
+                return CL_ERR;
+            }
+        }
+    } else if (cmd == server->commands[CMD_STATS]) {
+        const Compressor *z = &server->compressor;
+        uint64_t forwarded = 0, writes = 0;
+        int owner = server->cluster.room.owner;
+        for (int i = 0; i < server->cluster.npeers; i++) {
+            forwarded += server->cluster.peers[i].frames;
+            writes += server->cluster.peers[i].writes;
+        }
+        size_t msglen;
+        char *msg = arena_catf(
+            &server->scratch, NULL, &msglen,
+            "Server\r\nconnections %lu messages %lu compressed %lu sent %lu "
+            "ratio %.2f cpu %.2fus/msg presence %lu coalesced %lu notices "
+            "%lu for %lu joins/leaves forwarded %lu in %lu writes owner %s "
+            "gaps %lu dups %lu\n",
+            server->stats.connections, server->stats.messages, z->frames,
+            z->sent, z->bytes_in ? (double)z->bytes_out / z->bytes_in : 1.0,
+            z->frames ? z->ns / 1e3 / z->frames : 0.0,
+            server->presence.updates, server->presence.coalesced,
+            server->notices.sent, server->notices.total, forwarded, writes,
+            owner < 0 ? "self" : server->cluster.peers[owner].addr,
+            server->cluster.room.gaps, server->cluster.room.dups);
+        if (client_send_message(server, c, LANE_CONTROL, msg, msglen) ==
+            CL_ERR) {
+            client_detach(server, c);
+            return CL_ERR;
+        }
+    }
     return CL_OK;
-err:
-    return CL_ERR;
 }
 
-static int cl_accept(Server *server) {
-    int fd;
-    struct sockaddr_in addr;
-    socklen_t addrlen = sizeof(addr);
+/*
+ * Dispatch every complete line of `data` in order, `data[len]` being
+ * writable, returns the bytes consumed or -1 if the client is gone after
+ * them. A line longer than LINE_MAXLEN goes out in pieces, each one
+ * terminated by a newline of its own, as the framing expects.
+ */
+static ssize_t client_dispatch(Server *server, Client *c, char *data,
+                               size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        char *line = data + off;
+        size_t max =
+            len - off < LINE_MAXLEN - 1 ? len - off : LINE_MAXLEN - 1;
+        char *nl = memchr(line, '\n', max);
+        if (nl == NULL && max < LINE_MAXLEN - 1)
+            break;
+        size_t n = nl ? (size_t)(nl - line) + 1 : max;
+        if (nl) {
+            char next = line[n];
+            line[n] = '\0';
+            if (client_command(server, c, line, n) == CL_ERR)
+                return -1;
+            line[n] = next;
+        } else {
+            char *piece = arena_alloc(&server->scratch, n + 2);
+            memcpy(piece, line, n);
+            piece[n] = '\n';
+            piece[n + 1] = '\0';
+            if (client_command(server, c, piece, n + 1) == CL_ERR)
+                return -1;
+        }
+        off += n;
+        // A file sent takes what follows its /send line, see FILE TRANSFER
+        Transfer *tr = c->transfer;
+        if (tr && tr->from == c->fd && tr->left > 0) {
+            size_t feed = len - off < tr->left ? len - off : tr->left;
+            if (transfer_feed(tr, data + off, feed) == CL_ERR) {
+                client_detach(server, c);
+                return -1;
+            }
+            off += feed;
+            if (tr->left > 0)
+                break;
+        }
+    }
+    return off;
+}
 
-    /* Let's accept on listening socket */
-    fd = accept(server->fd, (struct sockaddr *)&addr, &addrlen);
-    if (fd <= 0)
-        goto exit;
+/*
+ * Process `len` bytes read from a client into `buf`, nul terminated,
+ * after the incomplete line kept from the previous read, if any. All the
+ * lines a read completes are dispatched in the same wake up, what they
+ * send is flushed once at the end of it, see EVENT LOOP. Returns CL_ERR if
+ * the client is gone.
+ */
+static int client_input(Server *server, Client *c, char *buf, size_t len) {
+    Buffer *in = &c->in;
+    if (buffer_pending(in) > 0) {
+        buffer_append(in, buf, len + 1);
+        in->len--;
+        buf = in->data;
+        len = in->len;
+    }
+    ssize_t n = client_dispatch(server, c, buf, len);
+    if (n < 0)
+        return CL_ERR;
+    if (buf == in->data) {
+        memmove(in->data, in->data + n, len - n);
+        in->len = len - n;
+    } else if ((size_t)n < len) {
+        buffer_append(in, buf + n, len - n);
+    }
+    client_charge(server, c);
+    return CL_OK;
+}
 
-    (void)set_nonblocking(fd);
-    return fd;
-exit:
-    if (errno != EWOULDBLOCK && errno != EAGAIN)
-        perror("accept");
-    return CL_ERR;
+/*
+ * Read and process what a client sent, be it raw lines or WebSocket
+ * messages, up to the read budget; what's left is read on the next
+ * iteration
+ */
+static void client_read(Server *server, Client *c) {
+    // Room for a whole WebSocket message, newline and nul added, so it's
+    // cut in lines by client_dispatch as raw input is
+    char buf[WS_MAXLEN + 2];
+    int fd = c->fd;
+    ssize_t budget = server->config.read_budget;
+    c->read_at = server->loop.iterations;
+
+    // Not read until its output goes down, see MEMORY; a transfer must go on
+    if (c->transfer == NULL && client_over(server, c))
+        client_shrink(server, c);
+    if (c->transfer == NULL && client_over(server, c)) {
+        if (!c->paused) {
+            c->paused = 1;
+            server->memory.paused++;
+        }
+        return;
+    }
+
+    if (server->ws[fd]) {
+        Buffer reply = {0};
+        int gone = 0;
+        // Lines that came in the auth message, complete as ws_parse ends
+        // every message with a newline
+        buf[0] = '\0';
+        if (buffer_pending(&c->in) > 0 &&
+            client_input(server, c, buf, 0) == CL_ERR)
+            return;
+        for (;;) {
+            if (budget <= 0) {
+                loop_requeue(&server->loop, c);
+                break;
+            }
+            ssize_t n = ws_recv(server, fd, buf, sizeof(buf), &reply);
+            if (reply.len > 0) {
+                (void)client_send(server, c, LANE_CONTROL, reply.data,
+                                  reply.len);
+                reply.len = 0;
+            }
+            if (n < 0) {
+                client_detach(server, c);
+                gone = 1;
+            }
+            if (n <= 0)
+                break;
+            budget -= n;
+            // Split in lines like raw input, a message can carry several
+            if (client_input(server, c, buf, n) == CL_ERR) {
+                gone = 1;
+                break;
+            }
+        }
+        free(reply.data);
+        if (!gone)
+            client_charge(server, c);
+        return;
+    }
+
+    // A file being sent has the socket, until it's all in the pipe
+    if (c->transfer) {
+        if (transfer_pump(server, c) == CL_ERR)
+            return;
+        if (c->transfer && c->transfer->from == fd && c->transfer->left > 0)
+            return;
+    }
+
+    // Lines that came along with the auth one
+    buf[0] = '\0';
+    if (buffer_pending(&c->in) > 0 && client_input(server, c, buf, 0) == CL_ERR)
+        return;
+
+    // Until the socket, and TLS with it, has nothing more to give
+    for (;;) {
+        if (budget <= 0) {
+            loop_requeue(&server->loop, c);
+            break;
+        }
+        ssize_t nread = cl_read(server, fd, buf, sizeof(buf) - 1);
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (nread <= 0) {
+            // A last line without a newline is still a message
+            if (nread == 0 && buffer_pending(&c->in) > 0) {
+                buffer_append(&c->in, "\n", 2);
+                if (client_command(server, c, c->in.data, c->in.len - 1) ==
+                    CL_ERR)
+                    break;
+            }
+            client_detach(server, c);
+            break;
+        }
+        buf[nread] = 0;
+        budget -= nread;
+        if (client_input(server, c, buf, nread) == CL_ERR)
+            break;
+        if (c->transfer && c->transfer->from == fd) {
+            (void)transfer_pump(server, c);
+            break;
+        }
+    }
 }
 
-/**
- * Simple broadcast function, for now we just assume all non connected FDs
- * are set to 0 as per initialization of the server struct in the main
- * function.
+/*
+ * Read the clients left over by the previous iteration, the ones already
+ * read by an event of this one wait for the next. Reading may drop other
+ * clients from the list, and put back the one read, so it's popped a
+ * client at a time for as many clients as it held.
  */
-void broadcast_message(Server *server, const char *buf, int fd,
-                       int server_info) {
-    int nwrite = 0;
-    Client *sender = server->clients[fd];
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        Client *c = server->clients[i];
-        if (c == NULL || i == fd)
+static void client_read_ready(Server *server) {
+    Loop *l = &server->loop;
+    for (int n = l->nready; n > 0; n--) {
+        Client *c = loop_pop(l);
+        if (c == NULL)
+            break;
+        if (c->read_at == l->iterations)
+            loop_requeue(l, c);
+        else
+            client_read(server, c);
+    }
+}
+
+/*
+ * =====================================================
+ *                 CONFIGURATION
+ * =====================================================
+ *
+ * Every option is set, in increasing order of precedence, by the defaults
+ * at the top of this file, the CHATLITE_* environment variables, a config
+ * file given with -c <path> and --<option> <value> flags. The file holds
+ * an option per line
+ *
+ * # Comment
+ * max_clients 4096
+ * history_replay_chunk 131072
+ *
+ * SIGHUP loads the whole chain again: the file is read anew and the flags
+ * reapplied on top. Reloadable options take effect straight away, the
+ * ones applied to sockets at accept on the next connections; the others
+ * size the fd tables or own a listener and wait for a restart or a hot
+ * upgrade, which passes the flags on. A config that doesn't load is
+ * discarded as a whole, the running one is kept.
+ */
+
+#define CONFIG_INT 0
+#define CONFIG_STR 1
+
+typedef struct {
+    const char *name;
+    uint8_t type;
+    uint8_t reloadable;
+    size_t offset;
+    size_t size;
+    long min;
+    long max;
+} ConfigOption;
+
+#define CONFIG_INT_OPTION(field, min, max, reloadable)                        \
+    {#field, CONFIG_INT, reloadable, offsetof(Config, field), sizeof(int),    \
+     min, max}
+#define CONFIG_STR_OPTION(field, reloadable)                                   \
+    {#field,     CONFIG_STR,                                                   \
+     reloadable, offsetof(Config, field),                                      \
+     sizeof(((Config *)0)->field), 0,                                          \
+     0}
+
+static const ConfigOption config_options[] = {
+    CONFIG_STR_OPTION(addr, 0),
+    CONFIG_INT_OPTION(port, 1, 65535, 0),
+    CONFIG_INT_OPTION(ws_port, 1, 65535, 0),
+    CONFIG_STR_OPTION(unix_path, 0),
+    CONFIG_INT_OPTION(backlog, 1, 65535, 0),
+    CONFIG_INT_OPTION(max_clients, 64, 1 << 20, 0),
+    CONFIG_STR_OPTION(token, 0),
+    CONFIG_STR_OPTION(cluster, 0),
+    CONFIG_STR_OPTION(peers, 0),
+    CONFIG_INT_OPTION(max_events, 1, 65536, 1),
+    CONFIG_INT_OPTION(read_budget, MESSAGE_MAXLEN, 1 << 24, 1),
+    CONFIG_INT_OPTION(busy_poll, 0, 1000000, 1),
+    CONFIG_INT_OPTION(cpu, -1, CPU_SETSIZE - 1, 0),
+    CONFIG_INT_OPTION(cork, 0, 1, 1),
+    CONFIG_INT_OPTION(nick_maxlen, 2, NICK_MAXLEN, 1),
+    CONFIG_INT_OPTION(auth_timeout, 1, 3600, 1),
+    CONFIG_INT_OPTION(resume_grace, 0, 86400, 1),
+    CONFIG_INT_OPTION(history_default, 1, HISTORY_MAXLEN, 1),
+    CONFIG_INT_OPTION(history_replay_chunk, 4096, 16 << 20, 1),
+    CONFIG_INT_OPTION(history_segment_size, 1 << 16, 1 << 30, 1),
+    CONFIG_INT_OPTION(outq_low_watermark, 1024, 16 << 20, 1),
+    CONFIG_INT_OPTION(outq_shed, 1024, 1 << 30, 1),
+    CONFIG_INT_OPTION(client_mem_max, 64 * 1024, INT_MAX, 1),
+    CONFIG_INT_OPTION(mem_max, 1024 * 1024, INT_MAX, 1),
+    CONFIG_INT_OPTION(link_maxpending, 1 << 16, 1 << 30, 1),
+    CONFIG_INT_OPTION(snapshot_interval, 1, 3600, 1),
+    CONFIG_INT_OPTION(drain_timeout_ms, 0, 600000, 1),
+    CONFIG_INT_OPTION(transfer_idle, 1, 3600, 1),
+    CONFIG_INT_OPTION(friends_max, 0, 65536, 1),
+    CONFIG_INT_OPTION(presence_interval, 0, 60000, 1),
+    CONFIG_INT_OPTION(notices_window, 1, 60000, 1),
+    CONFIG_INT_OPTION(notices_window_max, 1, 60000, 1),
+    CONFIG_INT_OPTION(notices_burst, 1, 1 << 20, 1),
+};
+
+#define CONFIG_OPTIONS (sizeof(config_options) / sizeof(config_options[0]))
+
+// Environment variables predating the config file, and their options
+static const char *const config_env[][2] = {
+    {"CHATLITE_PORT", "port"},       {"CHATLITE_WS_PORT", "ws_port"},
+    {"CHATLITE_UNIX", "unix_path"},  {"CHATLITE_TOKEN", "token"},
+    {"CHATLITE_CLUSTER", "cluster"}, {"CHATLITE_PEERS", "peers"},
+};
+
+static void config_defaults(Config *cfg) {
+    *cfg = (Config){.addr = ADDR,
+                    .port = PORT,
+                    .ws_port = WS_PORT,
+                    .unix_path = UNIX_PATH,
+                    .backlog = BACKLOG,
+                    .max_clients = MAX_CLIENTS,
+                    .max_events = MAX_EVENTS,
+                    .read_budget = READ_BUDGET,
+                    .busy_poll = BUSY_POLL,
+                    .cpu = LOOP_CPU,
+                    .cork = FLUSH_CORK,
+                    .nick_maxlen = NICK_MAXLEN,
+                    .auth_timeout = AUTH_TIMEOUT,
+                    .resume_grace = RESUME_GRACE,
+                    .history_default = HISTORY_DEFAULT,
+                    .history_replay_chunk = HISTORY_REPLAY_CHUNK,
+                    .history_segment_size = HISTORY_SEGMENT_SIZE,
+                    .outq_low_watermark = OUTQ_LOW_WATERMARK,
+                    .outq_shed = OUTQ_SHED,
+                    .client_mem_max = CLIENT_MEM_MAX,
+                    .mem_max = MEM_MAX,
+                    .link_maxpending = LINK_MAXPENDING,
+                    .snapshot_interval = SNAPSHOT_INTERVAL,
+                    .drain_timeout_ms = DRAIN_TIMEOUT_MS,
+                    .transfer_idle = TRANSFER_IDLE,
+                    .friends_max = FRIENDS_MAX,
+                    .presence_interval = PRESENCE_INTERVAL,
+                    .notices_window = NOTICES_WINDOW,
+                    .notices_window_max = NOTICES_WINDOW_MAX,
+                    .notices_burst = NOTICES_BURST};
+}
+
+static const ConfigOption *config_option(const char *name) {
+    for (size_t i = 0; i < CONFIG_OPTIONS; i++)
+        if (strcmp(config_options[i].name, name) == 0)
+            return &config_options[i];
+    return NULL;
+}
+
+// Set option `name` from its text, errors are reported as from `where`
+static int config_set(Config *cfg, const char *name, const char *value,
+                      const char *where) {
+    const ConfigOption *opt = config_option(name);
+    if (opt == NULL) {
+        fprintf(stderr, "%s: unknown option %s\n", where, name);
+        return CL_ERR;
+    }
+    char *field = (char *)cfg + opt->offset;
+    if (opt->type == CONFIG_STR) {
+        size_t len = strlen(value);
+        if (len >= opt->size) {
+            fprintf(stderr, "%s: %s longer than %zu\n", where, name,
+                    opt->size - 1);
+            return CL_ERR;
+        }
+        memcpy(field, value, len + 1);
+        return CL_OK;
+    }
+    char *end;
+    errno = 0;
+    long n = strtol(value, &end, 0);
+    if (errno != 0 || end == value || *end != '\0' || n < opt->min ||
+        n > opt->max) {
+        fprintf(stderr, "%s: %s must be an integer in [%ld, %ld]\n", where,
+                name, opt->min, opt->max);
+        return CL_ERR;
+    }
+    *(int *)field = n;
+    return CL_OK;
+}
+
+static int config_file(Config *cfg, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "config: can't open %s: %s\n", path, strerror(errno));
+        return CL_ERR;
+    }
+    char line[CONFIG_LINE_MAXLEN], where[PATH_MAX + 16];
+    int rc = CL_OK;
+    for (int n = 1; rc == CL_OK && fgets(line, sizeof(line), f); n++) {
+        char *name = trim_string(line);
+        if (*name == '\0' || *name == '#')
+            continue;
+        char *value = name + strcspn(name, " \t");
+        if (*value != '\0')
+            *value++ = '\0';
+        snprintf(where, sizeof(where), "%s:%d", path, n);
+        rc = config_set(cfg, name, trim_string(value), where);
+    }
+    fclose(f);
+    return rc;
+}
+
+/*
+ * Build the configuration out of the defaults, the environment, the file
+ * given with -c and the flags in `argv`; --upgrade <fd> is left to main
+ */
+static int config_load(Config *cfg, int argc, char **argv) {
+    config_defaults(cfg);
+    for (size_t i = 0; i < sizeof(config_env) / sizeof(config_env[0]); i++) {
+        const char *value = getenv(config_env[i][0]);
+        // Empty means default, except for strings where it disables
+        if (value == NULL ||
+            (*value == '\0' &&
+             config_option(config_env[i][1])->type == CONFIG_INT))
+            continue;
+        if (config_set(cfg, config_env[i][1], value, config_env[i][0]) ==
+            CL_ERR)
+            return CL_ERR;
+    }
+
+    // The file goes first, so flags override it wherever they are
+    for (int i = 1; i < argc - 1; i++)
+        if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) &&
+            config_file(cfg, argv[++i]) == CL_ERR)
+            return CL_ERR;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0 && strcmp(argv[i], "-c") != 0) {
+            fprintf(stderr, "flags: unexpected argument %s\n", argv[i]);
+            return CL_ERR;
+        }
+        if (i == argc - 1) {
+            fprintf(stderr, "flags: %s needs a value\n", argv[i]);
+            return CL_ERR;
+        }
+        const char *name = argv[i] + (argv[i][1] == '-' ? 2 : 1);
+        const char *value = argv[++i];
+        if (strcmp(name, "c") == 0 || strcmp(name, "config") == 0 ||
+            strcmp(name, "upgrade") == 0)
             continue;
-        CL_LOG("Broadcasting to %s\n", c->nick);
-        char msg[256];
-        int msglen = 0;
-        if (!server_info)
-            msglen = snprintf(msg, sizeof(msg), "%s\r\n%s", sender->nick, buf);
+        if (config_set(cfg, name, value, "flags") == CL_ERR)
+            return CL_ERR;
+    }
+
+    if (cfg->notices_window > cfg->notices_window_max) {
+        fprintf(stderr, "config: notices_window above notices_window_max\n");
+        return CL_ERR;
+    }
+    return CL_OK;
+}
+
+static void config_usage(const char *prog) {
+    Config cfg;
+    config_defaults(&cfg);
+    fprintf(stderr, "Usage: %s [-c <config file>] [--<option> <value>]...\n\n",
+            prog);
+    fprintf(stderr, "Options, * for the ones reloaded on SIGHUP:\n");
+    for (size_t i = 0; i < CONFIG_OPTIONS; i++) {
+        const ConfigOption *opt = &config_options[i];
+        const char *field = (const char *)&cfg + opt->offset;
+        if (opt->type == CONFIG_STR)
+            fprintf(stderr, "  %c %-22s %s\n", opt->reloadable ? '*' : ' ',
+                    opt->name, field);
         else
-            msglen = snprintf(msg, sizeof(msg), "Server\r\n%s", buf);
-        nwrite = write(c->fd, msg, msglen);
-        if (nwrite < 0)
-            perror("write(3)");
+            fprintf(stderr, "  %c %-22s %d\n", opt->reloadable ? '*' : ' ',
+                    opt->name, *(const int *)field);
+    }
+}
+
+// Put the reloadable options in effect where they're cached or armed
+static void config_apply(Server *server) {
+    const Config *cfg = &server->config;
+    server->history.segment_max = cfg->history_segment_size;
+
+    Notices *n = &server->notices;
+    if (n->window < (uint32_t)cfg->notices_window)
+        n->window = cfg->notices_window;
+    if (n->window > (uint32_t)cfg->notices_window_max)
+        n->window = cfg->notices_window_max;
+
+    struct itimerspec interval = {
+        .it_interval = {cfg->snapshot_interval, 0},
+        .it_value = {cfg->snapshot_interval, 0}};
+    if (timerfd_settime(server->timerfd, 0, &interval, NULL) == -1)
+        perror("timerfd_settime");
+
+    // The caps may be lower now
+    server->memory.over = 1;
+}
+
+// SIGHUP, load the configuration again and take the reloadable changes
+static void config_reload(Server *server) {
+    Config next;
+    if (config_load(&next, exe_argc, exe_argv) == CL_ERR) {
+        CL_LOG("%s\n", "Config reload failed, keeping the running one");
+        return;
+    }
+    int changed = 0;
+    for (size_t i = 0; i < CONFIG_OPTIONS; i++) {
+        const ConfigOption *opt = &config_options[i];
+        char *cur = (char *)&server->config + opt->offset;
+        const char *val = (const char *)&next + opt->offset;
+        if (opt->type == CONFIG_STR ? strcmp(cur, val) == 0
+                                    : memcmp(cur, val, opt->size) == 0)
+            continue;
+        if (!opt->reloadable) {
+            CL_LOG("Config %s changed, takes a restart\n", opt->name);
+            continue;
+        }
+        memcpy(cur, val, opt->size);
+        changed++;
+        if (opt->type == CONFIG_STR)
+            CL_LOG("Config %s set to %s\n", opt->name, cur);
+        else
+            CL_LOG("Config %s set to %d\n", opt->name, *(int *)cur);
+    }
+    config_apply(server);
+    CL_LOG("Config reloaded, %d options changed\n", changed);
+}
+
+/*
+ * =====================================================
+ *                 GRACEFUL SHUTDOWN
+ * =====================================================
+ *
+ * SIGTERM or SIGINT put the server in drain mode: no more connections are
+ * accepted and no more input is processed, clients are notified and the
+ * event loop keeps running only to deliver what's pending for them, both
+ * in userspace and in the kernel send queues. Backlog replays are cut at
+ * the frame in flight. Once everything is delivered, or drain_timeout_ms
+ * expire, storage is synced and the process exits.
+ */
+
+static inline int draining(const Server *server) {
+    return server->drain_deadline > 0;
+}
+
+static void drain_start(Server *server) {
+    CL_LOG("Draining, exiting in at most %d ms\n",
+           server->config.drain_timeout_ms);
+    server->drain_deadline = now_ms() + server->config.drain_timeout_ms;
+
+    // Paused listeners are already out of epoll, see accept_pause
+    int paused = server->accept_resume != 0;
+    server->accept_resume = 0;
+    int listeners[] = {server->fd, server->ws_fd};
+    for (size_t i = 0; i < sizeof(listeners) / sizeof(listeners[0]); i++) {
+        if (!paused &&
+            epoll_ctl(server->epollfd, EPOLL_CTL_DEL, listeners[i], NULL) < 0)
+            perror("epoll_ctl: server fd");
+        close(listeners[i]);
+    }
+    server->fd = server->ws_fd = -1;
+    if (server->unix_fd >= 0) {
+        if (!paused && epoll_ctl(server->epollfd, EPOLL_CTL_DEL,
+                                 server->unix_fd, NULL) < 0)
+            perror("epoll_ctl: unix fd");
+        close(server->unix_fd);
+        unlink(server->config.unix_path);
+        server->unix_fd = -1;
+    }
+    if (server->cluster.fd >= 0) {
+        if (epoll_ctl(server->epollfd, EPOLL_CTL_DEL, server->cluster.fd,
+                      NULL) < 0)
+            perror("epoll_ctl: cluster fd");
+        close(server->cluster.fd);
+        server->cluster.fd = -1;
+    }
+
+    for (int fd = 0; fd < server->config.max_clients; fd++)
+        if (server->preauth[fd].deadline)
+            preauth_close(server, fd);
+
+    for (int i = 0; i < server->config.max_clients; i++) {
+        Client *c = server->clients[i];
+        if (c != NULL)
+            c->replay.end = c->replay.next + (c->replay.sent > 0);
+    }
+    const char *notice = "Server shutting down\n";
+    broadcast_message(server, notice, strlen(notice), -1, LANE_CONTROL);
+}
+
+static int drain_done(const Server *server) {
+    if (now_ms() >= server->drain_deadline)
+        return 1;
+    for (int i = 0; i < server->config.max_clients; i++) {
+        Client *c = server->clients[i];
+        if (c == NULL)
+            continue;
+        int unsent = 0;
+        if (client_pending(c) > 0 || history_replaying(&c->replay) ||
+            (ioctl(c->fd, SIOCOUTQ, &unsent) == 0 && unsent > 0))
+            return 0;
+    }
+    return 1;
+}
+
+static void drain_exit(Server *server) {
+    History *h = &server->history;
+    for (int i = 0; i < HISTORY_SEGMENTS; i++)
+        if (h->fds[i] >= 0 && fdatasync(h->fds[i]) < 0)
+            perror("fdatasync history");
+    (void)snapshot_sync(server);
+
+    int nclients = 0;
+    for (int i = 0; i < server->config.max_clients; i++) {
+        if (server->clients[i]) {
+            client_free(server, server->clients[i]);
+            nclients++;
+        }
     }
+    CL_LOG("Drained, closed %d clients, bye\n", nclients);
+    exit(EXIT_SUCCESS);
 }
 
-int main(void) {
+int main(int argc, char **argv) {
 
-    CL_LOG("Server init on %s:%d\n\n", ADDR, PORT);
+    // An upgrading process passes the handover socket as --upgrade <fd>
+    int upgrade_fd = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            config_usage(argv[0]);
+            return EXIT_SUCCESS;
+        }
+        if (strcmp(argv[i], "--upgrade") == 0 && i + 1 < argc)
+            upgrade_fd = atoi(argv[i + 1]);
+    }
+
+    exe_resolve(argv[0]);
+    exe_argc = argc;
+    exe_argv = argv;
+
+    Server server = {.fd = 0, .unix_fd = -1};
+    if (config_load(&server.config, argc, argv) == CL_ERR)
+        return CL_ERR;
+    const Config *cfg = &server.config;
+    CL_LOG("Server init on %s:%d\n\n", cfg->addr, cfg->port);
 
-    char token[16] = {0};
-    char buf[256] = {0};
-    generate_random_token(token);
+    // The tables indexed by fd
+    server.clients = cl_calloc(cfg->max_clients, sizeof(Client *));
+    server.ws = cl_calloc(cfg->max_clients, sizeof(WsConn *));
+    server.links = cl_calloc(cfg->max_clients, sizeof(Link *));
+    server.preauth = cl_calloc(cfg->max_clients, sizeof(Preauth));
+#ifdef HAVE_TLS
+    server.tls = cl_calloc(cfg->max_clients, sizeof(SSL *));
+    server.ktls = cl_calloc(cfg->max_clients, sizeof(uint8_t));
+#endif
 
-    CL_LOG("Token: %s\n", token);
+    if (cluster_init(&server.cluster, cfg) == CL_ERR)
+        return CL_ERR;
+    sessions_init(&server.sessions);
+    notices_init(&server.notices, cfg->notices_window);
+    commands_init(&server);
 
-    Server server = {.fd = 0, .clients = {NULL}};
+    // A fixed token survives restarts, otherwise a fresh one is generated
+    if (cfg->token[0] != '\0')
+        snprintf(server.token, sizeof(server.token), "%s", cfg->token);
+    else
+        generate_random_token(server.token, TOKEN_LEN);
 
-    // Make the server listen unblocking
-    if (cl_listen(&server, ADDR, PORT, BACKLOG) == -1) {
-        fprintf(stderr, "Error listening on %s:%i\n", ADDR, PORT);
+    /*
+     * Signals are handled synchronously in the event loop, they must be
+     * blocked before any thread is spawned
+     */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        perror("sigprocmask");
         return CL_ERR;
     }
+    signal(SIGPIPE, SIG_IGN);
 
     int nfds = 0;
-    int epollfd = epoll_create1(0);
-    if (epollfd == -1) {
+    server.epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (server.epollfd == -1) {
         perror("epoll_create1");
         return CL_ERR;
     }
 
+#ifdef HAVE_TLS
+    if (tls_init(&server) == CL_ERR)
+        return CL_ERR;
+#endif
+
+    if (compress_init(&server.compressor) == CL_ERR)
+        return CL_ERR;
+
+    if (upgrade_fd >= 0) {
+        if (upgrade_receive(&server, upgrade_fd) == CL_ERR)
+            return CL_ERR;
+    } else {
+        CL_LOG("Token: %s\n", server.token);
+
+        if (snapshot_load(&server) == CL_ERR &&
+            history_init(&server.history) == CL_ERR)
+            return CL_ERR;
+
+        // Make the server listen unblocking
+        server.fd = cl_listen(cfg->addr, cfg->port, cfg->backlog);
+        if (server.fd == CL_ERR) {
+            fprintf(stderr, "Error listening on %s:%i\n", cfg->addr,
+                    cfg->port);
+            return CL_ERR;
+        }
+        server.ws_fd = cl_listen(cfg->addr, cfg->ws_port, cfg->backlog);
+        if (server.ws_fd == CL_ERR) {
+            fprintf(stderr, "Error listening on %s:%i\n", cfg->addr,
+                    cfg->ws_port);
+            return CL_ERR;
+        }
+        CL_LOG("WebSocket on %s:%d\n", cfg->addr, cfg->ws_port);
+        if (cfg->unix_path[0] != '\0') {
+            server.unix_fd = cl_listen_unix(cfg->unix_path, cfg->backlog);
+            if (server.unix_fd == CL_ERR) {
+                fprintf(stderr, "Error listening on %s\n", cfg->unix_path);
+                return CL_ERR;
+            }
+            CL_LOG("Unix socket on %s\n", cfg->unix_path);
+        }
+    }
+
+    if (snapshot_start(&server.snapshotter) == CL_ERR)
+        return CL_ERR;
+    // After the snapshot writer is spawned, so that it's not pinned too
+    if (cfg->cpu >= 0 && loop_pin(cfg->cpu) == CL_ERR)
+        return CL_ERR;
+
     // Register the server listening socket into the epoll loop
     ev.events = EPOLLIN;
     ev.data.fd = server.fd;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, server.fd, &ev) == -1) {
+    if (epoll_ctl(server.epollfd, EPOLL_CTL_ADD, server.fd, &ev) == -1) {
         perror("epoll_ctl: server fd");
         return CL_ERR;
     }
+    ev.data.fd = server.ws_fd;
+    if (epoll_ctl(server.epollfd, EPOLL_CTL_ADD, server.ws_fd, &ev) == -1) {
+        perror("epoll_ctl: websocket fd");
+        return CL_ERR;
+    }
+    ev.data.fd = server.unix_fd;
+    if (server.unix_fd >= 0 &&
+        epoll_ctl(server.epollfd, EPOLL_CTL_ADD, server.unix_fd, &ev) == -1) {
+        perror("epoll_ctl: unix fd");
+        return CL_ERR;
+    }
+    if (cluster_start(&server) == CL_ERR)
+        return CL_ERR;
+
+    // Register the housekeeping timer, firing every snapshot_interval, it's
+    // armed with the rest of the reloadable options
+    server.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (server.timerfd == -1) {
+        perror("timerfd");
+        return CL_ERR;
+    }
+    config_apply(&server);
+    ev.events = EPOLLIN;
+    ev.data.fd = server.timerfd;
+    if (epoll_ctl(server.epollfd, EPOLL_CTL_ADD, server.timerfd, &ev) == -1) {
+        perror("epoll_ctl: timer fd");
+        return CL_ERR;
+    }
+
+    // Register the signals
+    server.sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (server.sigfd == -1) {
+        perror("signalfd");
+        return CL_ERR;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = server.sigfd;
+    if (epoll_ctl(server.epollfd, EPOLL_CTL_ADD, server.sigfd, &ev) == -1) {
+        perror("epoll_ctl: signal fd");
+        return CL_ERR;
+    }
+
+    // Let the old process know we're up and serving
+    if (upgrade_fd >= 0) {
+        if (write(upgrade_fd, "K", 1) != 1)
+            perror("upgrade: ack");
+        close(upgrade_fd);
+    }
 
     // Start the event loop
+    int max_events = 0;
+    server.loop.batch = LOOP_BATCH_MIN;
     for (;;) {
-        nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+        // The batch cap is reloadable, events are never pending here
+        if (max_events != cfg->max_events) {
+            max_events = cfg->max_events;
+            events = cl_realloc(events, max_events * sizeof(*events));
+            loop_adapt(&server.loop, 0, max_events);
+        }
+        if (presence_timeout(&server) == 0)
+            presence_flush(&server);
+        if (notices_timeout(&server) == 0)
+            notices_flush(&server);
+        cluster_flush(&server);
+        client_flush_dirty(&server);
+        memory_enforce(&server);
+        // All that was formatted is in the lanes and the links by now
+        arena_reset(&server.scratch);
+        if (accept_timeout(&server) == 0)
+            accept_resume(&server);
+        int timeout =
+            timeout_min(presence_timeout(&server), notices_timeout(&server));
+        timeout = timeout_min(timeout, accept_timeout(&server));
+        if (draining(&server)) {
+            if (drain_done(&server))
+                drain_exit(&server);
+            // Kernel send queues don't wake the loop up, poll them
+            timeout = timeout_min(timeout, 50);
+        }
+        // Input left over from the last iteration is read straight away,
+        // and a busy polling loop never sleeps
+        if ((server.loop.ready && !draining(&server)) || cfg->busy_poll)
+            timeout = 0;
+        nfds = epoll_wait(server.epollfd, events, server.loop.batch, timeout);
         if (nfds == -1) {
             perror("epoll_wait");
             return CL_ERR;
         }
+        int64_t start = now_ns();
+        loop_adapt(&server.loop, nfds, max_events);
 
         for (int i = 0; i < nfds; ++i) {
-            if (events[i].data.fd == server.fd) {
-                int client_fd = cl_accept(&server);
+            if (events[i].data.fd == server.sigfd) {
+                struct signalfd_siginfo info;
+                while (read(server.sigfd, &info, sizeof(info)) > 0) {
+                    if (draining(&server))
+                        continue;
+                    if (info.ssi_signo == SIGUSR2)
+                        upgrade_start(&server);
+                    else if (info.ssi_signo == SIGHUP)
+                        config_reload(&server);
+                    else
+                        drain_start(&server);
+                }
+            } else if (events[i].data.fd == server.timerfd) {
+                uint64_t expirations;
+                if (read(server.timerfd, &expirations, sizeof(expirations)) >
+                    0) {
+                    snapshot_request(&server);
+                    preauth_expire(&server);
+                    transfer_expire(&server);
+                    memory_relieve(&server);
+                    sessions_expire(&server.sessions);
+                    cluster_redial(&server);
+                }
+            } else if (events[i].data.fd == server.fd ||
+                       events[i].data.fd == server.ws_fd ||
+                       events[i].data.fd == server.unix_fd) {
+                int client_fd =
+                    cl_accept(events[i].data.fd, cfg->outq_low_watermark,
+                              cfg->busy_poll);
+                // Aborted connections and the like are just skipped
                 if (client_fd == -1) {
-                    perror("accept");
-                    return CL_ERR;
+                    if (errno == EMFILE || errno == ENFILE)
+                        accept_pause(&server);
+                    continue;
                 }
                 (void)set_nonblocking(client_fd);
 
-                // Let's make a client here
-                Client *c = cl_malloc(sizeof(Client));
-                c->fd = client_fd;
-                snprintf(c->nick, sizeof(c->nick), "anon:%d", client_fd);
-                server.clients[client_fd] = c;
-
-                CL_LOG("New user %s connected\n", c->nick);
-
-                // Let's send a welcome message
-                int buflen = snprintf(
-                    buf, sizeof(buf),
-                    "Server\r\nWelcome %s! Use /nick to set a nickname\n\n",
-                    c->nick);
-                int nwrite = write(c->fd, buf, buflen);
-                if (nwrite < 0)
-                    perror("write welcome message");
-
-                // Let's broadcast the new joiner
-                memset(buf, 0x00, sizeof(buf));
-                size_t maxlen = strlen(c->nick) + 9;
-                snprintf(buf, maxlen, "%s joined\n", c->nick);
-                broadcast_message(&server, buf, client_fd, 1);
-
-                ev.events = EPOLLIN | EPOLLET;
-                ev.data.fd = client_fd;
-                if (epoll_ctl(epollfd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
-                    perror("epoll_ctl: client fd");
-                    return CL_ERR;
+                // Not a client until it authenticates
+                if (client_fd >= cfg->max_clients) {
+                    close(client_fd);
+                    continue;
                 }
+                preauth_add(&server, client_fd, events[i].data.fd);
+            } else if (events[i].data.fd == server.cluster.fd) {
+                cluster_accept(&server);
+            } else if (server.links[events[i].data.fd]) {
+                link_event(&server, server.links[events[i].data.fd],
+                           events[i].events);
+            } else if (server.preauth[events[i].data.fd].deadline) {
+                preauth_read(&server, events[i].data.fd);
             } else {
-                ssize_t nread = read(events[i].data.fd, buf, sizeof(buf) - 1);
-                if (nread < 0) {
-                    CL_LOG("Client disconnected fd=%i\n", events[i].data.fd);
-                    close(events[i].data.fd);
-                    free(server.clients[events[i].data.fd]);
-                } else {
-                    buf[nread] = 0;
-                    if (strncmp(buf, "/quit", 5) == 0) {
-                        // Client wants to disconnect here
-                        if (epoll_ctl(epollfd, EPOLL_CTL_DEL, events[i].data.fd,
-                                      NULL) < 0)
-                            perror("disconnecting client");
-                        Client *c = server.clients[events[i].data.fd];
-                        CL_LOG("User %s disconnected\n", c->nick);
-                        // Let's broadcast the user leaving
-                        memset(buf, 0x00, sizeof(buf));
-                        size_t maxlen = strlen(c->nick) + 7;
-                        snprintf(buf, maxlen, "%s left\n", c->nick);
-                        broadcast_message(&server, buf, c->fd, 1);
-                        close(events[i].data.fd);
-                        free(server.clients[events[i].data.fd]);
-                        server.clients[events[i].data.fd] = NULL;
-                    } else if (strncmp(buf, "/nick", 5) == 0) {
-                        Client *c = server.clients[events[i].data.fd];
-                        char raw_nick[NICK_MAXLEN];
-                        strncpy(raw_nick, buf + 5, nread);
-                        char *nick = trim_string(raw_nick);
-                        CL_LOG("User %s updating nick to %s\n", c->nick, nick);
-                        strncpy(c->nick, nick, strlen(raw_nick));
-                    } else {
-                        Client *c = server.clients[events[i].data.fd];
-                        CL_LOG("User: %s len: %li msg: %s", c->nick, nread,
-                               buf);
-                        broadcast_message(&server, buf, events[i].data.fd, 0);
+                Client *c = server.clients[events[i].data.fd];
+                if (c == NULL)
+                    continue;
+
+                if (events[i].events & EPOLLOUT) {
+                    if (client_flush(&server, c) == CL_ERR) {
+                        client_detach(&server, c);
+                        continue;
                     }
                 }
+
+                if (!(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                    continue;
+
+                // While draining input is ignored, only hangups matter
+                if (draining(&server) &&
+                    !(events[i].events & (EPOLLERR | EPOLLHUP)))
+                    continue;
+
+                client_read(&server, c);
             }
         }
+        if (nfds == 0 && server.loop.ready == NULL) {
+            server.loop.idle++;
+            continue;
+        }
+        if (!draining(&server))
+            client_read_ready(&server);
+        loop_record(&server.loop, now_ns() - start);
     }
 
     return 0;
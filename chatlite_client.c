@@ -35,6 +35,9 @@
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+
+#include "chatlite_dict.h"
 
 /*
  * Static flags to manage the terminal mode
@@ -158,6 +161,9 @@ void pty_clear_current_line(void) { write(STDOUT_FILENO, "\e[2K", 4); }
 void pty_cursor_at_line_start(void) { write(STDOUT_FILENO, "\r", 1); }
 
 #define BUFSIZE 1024
+// A whole compressed frame, its length is 2 bytes, and a message inflated
+#define FRAME_MAXLEN (2 + 65535)
+#define PLAIN_MAXLEN (1024 * 1024)
 #define IB_OK 0
 #define IB_ERR -1
 #define IB_NEWLINE 2
@@ -258,28 +264,86 @@ struct message {
 
 // Parse the buffer content coming from the server, populating a
 // struct message.
-// The protocol couldn't be simpler, just looking for a \r\n (assuming
-// every buffer contains already a complete message) to extract the
-// nick then the message:
+// The protocol couldn't be simpler, just looking for a \r\n to extract the
+// nick then for a \n to extract the message:
+//
+// <nick>\r\n<message>\n
 //
-// <nick>\r\n<message>\r\n
-int message_parse(const char *buf, struct message *msg, size_t len) {
+// A single read can carry more than one message (e.g. a history replay) or
+// just a part of one, so the number of bytes consumed is returned, 0 if the
+// buffer doesn't contain a complete message yet.
+size_t message_parse(const char *buf, struct message *msg, size_t len) {
     memset(msg->nick, 0x00, sizeof(msg->nick));
     memset(msg->content, 0x00, sizeof(msg->content));
-    int i = 0;
-    while (len--) {
-        char c = buf[i];
-        if (c == '\r')
-            break;
-        msg->nick[i++] = c;
-    }
-    msg->nick[i + 1] = '\0';
+    size_t i = 0;
+    // Skip empty lines between messages
+    while (i < len && buf[i] == '\n')
+        i++;
 
-    len -= 2;
-    i += 2;
-    memcpy(msg->content, buf + i, len);
+    size_t nick_start = i;
+    while (i + 1 < len && !(buf[i] == '\r' && buf[i + 1] == '\n'))
+        i++;
+    if (i + 1 >= len)
+        return 0;
+    size_t nick_len = i - nick_start;
 
-    return 0;
+    size_t content_start = i + 2;
+    const char *end = memchr(buf + content_start, '\n', len - content_start);
+    if (end == NULL)
+        return 0;
+    size_t content_len = end - (buf + content_start);
+
+    if (nick_len >= sizeof(msg->nick))
+        nick_len = sizeof(msg->nick) - 1;
+    memcpy(msg->nick, buf + nick_start, nick_len);
+    if (content_len >= sizeof(msg->content))
+        content_len = sizeof(msg->content) - 1;
+    memcpy(msg->content, buf + content_start, content_len);
+
+    return end - buf + 1;
+}
+
+// Once compression is on, every message from the server comes in a frame:
+//
+// <length, 2 bytes big-endian><message deflated with the shared dictionary>
+//
+// Returns the number of bytes consumed, 0 if the buffer doesn't contain a
+// complete frame yet; the message inflated is stored in *out, grown as needed
+// up to PLAIN_MAXLEN with *outcap its size, outlen set to its length (0 if
+// the frame couldn't be inflated).
+size_t frame_parse(z_stream *zs, const char *buf, size_t len, char **out,
+                   size_t *outcap, size_t *outlen) {
+    if (len < 2)
+        return 0;
+    size_t frame_len = ((unsigned char)buf[0] << 8) | (unsigned char)buf[1];
+    if (len < frame_len + 2)
+        return 0;
+
+    inflateReset(zs);
+    inflateSetDictionary(zs, (const Bytef *)chatlite_dict,
+                         sizeof(chatlite_dict) - 1);
+    zs->next_in = (Bytef *)buf + 2;
+    zs->avail_in = frame_len;
+    int ret;
+    *outlen = 0;
+    for (;;) {
+        zs->next_out = (Bytef *)*out + *outlen;
+        zs->avail_out = *outcap - *outlen;
+        ret = inflate(zs, Z_FINISH);
+        *outlen = zs->total_out;
+        if (ret == Z_STREAM_END || zs->avail_out > 0 ||
+            *outcap * 2 > PLAIN_MAXLEN)
+            break;
+        // Out of room, inflate goes on where it stopped
+        char *grown = realloc(*out, *outcap * 2);
+        if (grown == NULL)
+            break;
+        *out = grown;
+        *outcap *= 2;
+    }
+    if (ret != Z_STREAM_END)
+        *outlen = 0;
+    return frame_len + 2;
 }
 
 // Format a message to be correctly printed in the terminal
@@ -382,6 +446,13 @@ int pty_print_buffer(const struct buffer *b) {
 void pty_clear_screen(void) { write(STDOUT_FILENO, "\x1b[2J", 4); }
 
 int main(void) {
+    // The server admits only clients presenting its token
+    const char *token = getenv("CHATLITE_TOKEN");
+    if (token == NULL || *token == '\0') {
+        fprintf(stderr, "CHATLITE_TOKEN not set, see the server log\n");
+        exit(EXIT_FAILURE);
+    }
+
     int err = tty_raw_mode_enable(STDIN_FILENO);
     if (err < 0)
         exit(EXIT_FAILURE);
@@ -397,7 +468,27 @@ int main(void) {
     if (s < 0)
         exit(EXIT_FAILURE);
 
+    char auth[128];
+    int auth_len = snprintf(auth, sizeof(auth), "/auth %s\n", token);
+    if (write(s, auth, auth_len) != auth_len)
+        exit(EXIT_FAILURE);
+
+    // Compression is asked for once admitted, the server acks it with a
+    // last plain message
+    z_stream zs = {0};
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+        exit(EXIT_FAILURE);
+    bool compress_asked = false, compressed = false;
+
     fd_set readfds;
+    // Incoming data from the server, a message can span multiple reads
+    char inbuf[FRAME_MAXLEN];
+    size_t inlen = 0;
+    // Messages inflated, the buffer grows with the biggest one
+    size_t plain_cap = BUFSIZE;
+    char *plain = malloc(plain_cap);
+    if (plain == NULL)
+        exit(EXIT_FAILURE);
 
     while (1) {
 
@@ -417,16 +508,50 @@ int main(void) {
         memset(buf, 0x00, sizeof(buf));
 
         if (FD_ISSET(s, &readfds)) {
-            // Data from the server
-            ssize_t count = read(s, buf, sizeof(buf));
+            // Data from the server, appended to what's left of the last read
+            ssize_t count = read(s, inbuf + inlen, sizeof(inbuf) - inlen);
             if (count <= 0) {
                 printf("Connection lost\n");
                 exit(1);
             }
+            inlen += count;
+            size_t off = 0, n = 0;
             struct message m;
-            message_parse(buf, &m, count);
-            pty_print_message(&m);
+            while (!compressed &&
+                   (n = message_parse(inbuf + off, &m, inlen - off)) > 0) {
+                pty_print_message(&m);
+                off += n;
+                if (strcmp(m.nick, "Server") == 0 &&
+                    strcmp(m.content, "Compression on") == 0)
+                    compressed = true;
+            }
+            size_t plain_len = 0;
+            while (compressed &&
+                   (n = frame_parse(&zs, inbuf + off, inlen - off, &plain,
+                                    &plain_cap, &plain_len)) > 0) {
+                off += n;
+                size_t p = 0, k = 0;
+                while ((k = message_parse(plain + p, &m, plain_len - p)) > 0) {
+                    pty_print_message(&m);
+                    p += k;
+                }
+            }
+            // Keep the incomplete tail, drop it if it can't ever fit
+            inlen -= off;
+            if (inlen == sizeof(inbuf))
+                inlen = 0;
+            memmove(inbuf, inbuf + off, inlen);
             pty_refresh(&ib);
+
+            if (!compress_asked) {
+                char req[64];
+                int req_len = snprintf(
+                    req, sizeof(req), "/compress deflate %08lx\n",
+                    adler32(adler32(0, Z_NULL, 0), (const Bytef *)chatlite_dict,
+                            sizeof(chatlite_dict) - 1));
+                (void)write(s, req, req_len);
+                compress_asked = true;
+            }
         } else if (FD_ISSET(STDIN_FILENO, &readfds)) {
             // Data from the user typing on the terminal
             ssize_t count = read(STDIN_FILENO, buf, sizeof(buf));
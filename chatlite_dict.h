@@ -0,0 +1,57 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Andrea Baldan
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ */
+
+#ifndef CHATLITE_DICT_H
+#define CHATLITE_DICT_H
+
+/*
+ * Preset deflate dictionary shared by server and client, see the
+ * COMPRESSION section of chatlite.c. Chat lines are too short to compress
+ * on their own, priming every message with strings that chat traffic keeps
+ * repeating makes even a few words shrink. Deflate finds matches cheaper
+ * the closer they are to the end of the window, so the most frequent
+ * strings come last.
+ *
+ * Both ends must use the exact same bytes: the server only agrees to
+ * compress when the adler32 of the client copy matches its own, so any
+ * change here just disables compression for clients not yet updated.
+ */
+static const char chatlite_dict[] =
+    "https://www.http://.com/.org/.html.png.jpg.gif"
+    "Use /resume  to resume this session\n\n"
+    "Use /nick to set a nickname\n"
+    "Welcome back !\nWelcome ! "
+    "thank you thanks thx np sorry please sure maybe really actually "
+    "probably something anyone everyone nothing though because about "
+    "would could should think know want need going gonna work today "
+    "tomorrow tonight morning later again still just like good great "
+    "nice cool yeah yes not don't can't won't it's that's what's I'm "
+    "you're we're they're I'll you'll there their where when what why "
+    "how who which with from have has had this that they them then "
+    "than the and for are but you your was were will can all out "
+    "lol haha ok okay hey hi hello bye see you ? :) :D !\n"
+    " left\n joined\n"
+    "Server\r\nanon:";
+
+#endif